@@ -0,0 +1,92 @@
+// Replaces the global operator new and delete with ones that count into
+// allocationStats, so that every benchmark in the target can report what it
+// allocates. The nothrow versions go through these. Don't link this together with
+// an allocator that replaces them as well, like mimalloc's override.
+
+#include "alloc-counters.h"
+
+#include <cstdlib>
+#include <new>
+
+#include <malloc.h>
+
+namespace {
+
+// We count what malloc actually handed out, as that is also what we can find out
+// again when it is freed.
+void* counted(void* p) {
+    if (p == nullptr)
+        throw std::bad_alloc();
+
+    countAllocation(malloc_usable_size(p));
+    return p;
+}
+
+void uncounted(void* p) noexcept {
+    if (p != nullptr)
+        countDeallocation(malloc_usable_size(p));
+}
+
+void* alignedMalloc(const std::size_t size, const std::align_val_t al) {
+    const auto alignment = static_cast<std::size_t>(al);
+    // aligned_alloc wants the size to be a multiple of the alignment.
+    return std::aligned_alloc(alignment, (std::max<std::size_t>(size, 1) + alignment - 1) / alignment * alignment);
+}
+
+}
+
+void* operator new(const std::size_t size) {
+    return counted(std::malloc(std::max<std::size_t>(size, 1)));
+}
+
+void* operator new[](const std::size_t size) {
+    return counted(std::malloc(std::max<std::size_t>(size, 1)));
+}
+
+void* operator new(const std::size_t size, const std::align_val_t al) {
+    return counted(alignedMalloc(size, al));
+}
+
+void* operator new[](const std::size_t size, const std::align_val_t al) {
+    return counted(alignedMalloc(size, al));
+}
+
+void operator delete(void* p) noexcept {
+    uncounted(p);
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    uncounted(p);
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    uncounted(p);
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+    uncounted(p);
+    std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+    uncounted(p);
+    std::free(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+    uncounted(p);
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept {
+    uncounted(p);
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept {
+    uncounted(p);
+    std::free(p);
+}
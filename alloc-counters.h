@@ -0,0 +1,71 @@
+#pragma once
+
+// Counting what a benchmark allocates: how many allocations, how many bytes, and
+// the most it had allocated at once. The counts are fed either by the global
+// operator new in alloc-counters.cpp, or by an allocator that counts, like the
+// CountingAllocator of mimalloc-stuff. CountAllocations puts them in the counters
+// of a benchmark.
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// The counts are per thread, which keeps them cheap enough to leave on for every
+// allocation, but means that what other threads allocate isn't counted. live and
+// peak are signed, as a thread can free what another one allocated.
+struct AllocationStats {
+    std::size_t allocs;
+    std::size_t bytes;
+    std::int64_t live;
+    std::int64_t peak;
+};
+
+inline thread_local AllocationStats allocationStats{};
+
+inline void countAllocation(const std::size_t bytes) {
+    auto& stats = allocationStats;
+    stats.allocs++;
+    stats.bytes += bytes;
+    stats.live += static_cast<std::int64_t>(bytes);
+    stats.peak = std::max(stats.peak, stats.live);
+}
+
+inline void countDeallocation(const std::size_t bytes) {
+    allocationStats.live -= static_cast<std::int64_t>(bytes);
+}
+
+enum class AllocationsPer { Run, Iteration };
+
+// Reports what this thread allocates from here to the end of the scope, in the
+// counters allocs, bytes and peak_bytes of state. peak_bytes is the most that was
+// allocated at once, on top of what already was. Put it first in a benchmark to
+// count what setting up the structure costs. For a benchmark that builds its
+// structure in the loop, put it right before the loop with AllocationsPer::Iteration,
+// and allocs and bytes are divided by the iterations. What the benchmark allocates
+// after its loop is counted too, usually a couple of allocations for its counters.
+class CountAllocations {
+    benchmark::State& state_;
+    AllocationsPer per_;
+    AllocationStats start_;
+
+public:
+    explicit CountAllocations(benchmark::State& state, const AllocationsPer per = AllocationsPer::Run)
+        : state_{state}, per_{per}, start_{allocationStats} {
+        allocationStats.peak = allocationStats.live;
+    }
+
+    CountAllocations(const CountAllocations&) = delete;
+    CountAllocations& operator=(const CountAllocations&) = delete;
+
+    ~CountAllocations() {
+        const auto end = allocationStats;
+        const auto flags = per_ == AllocationsPer::Iteration ? benchmark::Counter::kAvgIterations : benchmark::Counter::kDefaults;
+
+        state_.counters["allocs"] = benchmark::Counter(static_cast<double>(end.allocs - start_.allocs), flags);
+        state_.counters["bytes"] = benchmark::Counter(static_cast<double>(end.bytes - start_.bytes), flags, benchmark::Counter::kIs1024);
+        state_.counters["peak_bytes"] = benchmark::Counter(static_cast<double>(end.peak - start_.live),
+            benchmark::Counter::kDefaults, benchmark::Counter::kIs1024);
+    }
+};
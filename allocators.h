@@ -0,0 +1,338 @@
+#pragma once
+
+// Allocators to plug into Vector2D, or any other standard container.
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+#include <sys/mman.h>
+
+// Hands out memory aligned to Alignment, typically a cache line or a page.
+template <typename T, std::size_t Alignment>
+struct AlignedAllocator {
+    static_assert(Alignment && (Alignment & (Alignment - 1)) == 0, "Alignment must be a power of 2");
+    static_assert(alignof(T) <= Alignment, "We can't align less than the type itself requires");
+
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() noexcept = default;
+
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept {}
+
+    [[nodiscard]] T* allocate(std::size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t{Alignment}));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        ::operator delete(p, n * sizeof(T), std::align_val_t{Alignment});
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const noexcept {
+        return true;
+    }
+};
+
+// Backs every allocation with 2MB huge pages, so that random access over large
+// arrays needs 512 times fewer TLB entries. We first try the reserved hugetlbfs
+// pages, and if there are none we fall back to asking for transparent huge pages
+// on a 2MB aligned mapping.
+//
+// Every allocation is rounded up to a whole huge page, so only use it for big ones.
+template <typename T>
+struct HugePageAllocator {
+    static constexpr std::size_t hugePageSize = 2 << 20;
+
+    using value_type = T;
+
+    HugePageAllocator() noexcept = default;
+
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U>&) noexcept {}
+
+    [[nodiscard]] static constexpr std::size_t mappedSize(std::size_t n) {
+        return (n * sizeof(T) + hugePageSize - 1) / hugePageSize * hugePageSize;
+    }
+
+    [[nodiscard]] T* allocate(std::size_t n) {
+        const auto bytes = mappedSize(n);
+
+        void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+            return static_cast<T*>(p);
+
+        // Transparent huge pages are only used for aligned 2MB ranges, so we map a
+        // page extra and trim the ends off.
+        p = ::mmap(nullptr, bytes + hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::bad_alloc();
+
+        auto* raw = static_cast<std::byte*>(p);
+        const auto misalignment = reinterpret_cast<std::uintptr_t>(raw) % hugePageSize;
+        const auto head = misalignment == 0 ? 0 : hugePageSize - misalignment;
+        if (0 < head)
+            ::munmap(raw, head);
+        if (head < hugePageSize)
+            ::munmap(raw + head + bytes, hugePageSize - head);
+
+        ::madvise(raw + head, bytes, MADV_HUGEPAGE);
+        return reinterpret_cast<T*>(raw + head);
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        ::munmap(p, mappedSize(n));
+    }
+
+    template <typename U>
+    bool operator==(const HugePageAllocator<U>&) const noexcept {
+        return true;
+    }
+};
+
+// Hands out memory by bumping a pointer through chunks taken from the global heap,
+// and never frees anything before it is destroyed. An allocation is then just an
+// add and a compare, and the objects come out packed in the order they were made.
+// This is the same idea as std::pmr::monotonic_buffer_resource, without the
+// virtual call. Each chunk is twice the size of the last one, up to maxChunk.
+class BumpArena {
+    struct Chunk {
+        Chunk* next;
+        std::size_t size;
+    };
+
+    static constexpr std::size_t maxChunk = 64 << 20;
+
+    std::byte* cur_{nullptr};
+    std::byte* end_{nullptr};
+    Chunk* chunks_{nullptr};
+    std::size_t nextChunk_;
+
+    // Not inlined, so that allocate stays small.
+    [[gnu::noinline]] void grow(const std::size_t bytes, const std::size_t alignment) {
+        // Rounded up, so that a chunk ends where anything but an over-aligned type
+        // could start.
+        constexpr std::size_t granule = alignof(std::max_align_t);
+        const auto size = (std::max(nextChunk_, sizeof(Chunk) + bytes + alignment) + granule - 1) / granule * granule;
+        nextChunk_ = std::min(2 * nextChunk_, maxChunk);
+
+        auto* chunk = static_cast<Chunk*>(::operator new(size));
+        chunk->next = chunks_;
+        chunk->size = size;
+        chunks_ = chunk;
+
+        cur_ = reinterpret_cast<std::byte*>(chunk + 1);
+        end_ = reinterpret_cast<std::byte*>(chunk) + size;
+    }
+
+public:
+    explicit BumpArena(const std::size_t firstChunk = 64 << 10) : nextChunk_{firstChunk} {}
+
+    ~BumpArena() {
+        release();
+    }
+
+    BumpArena(const BumpArena&) = delete;
+    BumpArena& operator=(const BumpArena&) = delete;
+
+    [[nodiscard]] void* allocate(const std::size_t bytes, const std::size_t alignment) {
+        auto addr = (reinterpret_cast<std::uintptr_t>(cur_) + alignment - 1) & ~(alignment - 1);
+        // Aligning can take us past the end, which the subtraction alone would wrap.
+        const auto end = reinterpret_cast<std::uintptr_t>(end_);
+        if (cur_ == nullptr || end < addr || end - addr < bytes) {
+            grow(bytes, alignment);
+            addr = (reinterpret_cast<std::uintptr_t>(cur_) + alignment - 1) & ~(alignment - 1);
+        }
+
+        cur_ = reinterpret_cast<std::byte*>(addr + bytes);
+        return reinterpret_cast<void*>(addr);
+    }
+
+    // Frees everything at once. Whatever was allocated must not be used again.
+    void release() noexcept {
+        while (chunks_ != nullptr) {
+            Chunk* next = chunks_->next;
+            ::operator delete(chunks_, chunks_->size);
+            chunks_ = next;
+        }
+        cur_ = end_ = nullptr;
+    }
+};
+
+// The standard allocator interface over a BumpArena, which must outlive it.
+// deallocate does nothing, the memory comes back when the arena goes.
+template <typename T>
+struct BumpAllocator {
+    using value_type = T;
+
+    BumpArena* arena;
+
+    explicit BumpAllocator(BumpArena& a) noexcept : arena{&a} {}
+
+    template <typename U>
+    BumpAllocator(const BumpAllocator<U>& other) noexcept : arena{other.arena} {}
+
+    [[nodiscard]] T* allocate(std::size_t n) {
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T*, std::size_t) noexcept {}
+
+    template <typename U>
+    bool operator==(const BumpAllocator<U>& other) const noexcept {
+        return arena == other.arena;
+    }
+};
+
+// Hands out nodes of a single size, carved from 64kB slabs, and keeps the freed ones
+// on an intrusive free list, so that both allocating and freeing are a couple of
+// instructions and never need a lock. The node freed last is handed out first,
+// while it is still in the cache, and as the nodes come from big slabs, the nodes
+// of a container stay close together in memory. Like BumpArena, the slabs are only
+// given back when the pool is destroyed. Nodes are aligned to 16 bytes.
+class FixedSizePool {
+    struct FreeNode {
+        FreeNode* next;
+    };
+
+    struct alignas(16) Slab {
+        Slab* next;
+    };
+
+    static constexpr std::size_t slabSize = 64 << 10;
+
+    std::size_t nodeSize_;
+    FreeNode* free_{nullptr};
+    std::byte* cur_{nullptr};
+    std::byte* end_{nullptr};
+    Slab* slabs_{nullptr};
+
+    [[gnu::noinline]] void* refill() {
+        auto* slab = static_cast<Slab*>(::operator new(slabSize));
+        slab->next = slabs_;
+        slabs_ = slab;
+
+        cur_ = reinterpret_cast<std::byte*>(slab + 1);
+        end_ = cur_ + (slabSize - sizeof(Slab)) / nodeSize_ * nodeSize_;
+
+        void* node = cur_;
+        cur_ += nodeSize_;
+        return node;
+    }
+
+public:
+    explicit FixedSizePool(const std::size_t nodeSize)
+        : nodeSize_{(std::max(nodeSize, sizeof(FreeNode)) + alignof(Slab) - 1) / alignof(Slab) * alignof(Slab)} {}
+
+    ~FixedSizePool() {
+        while (slabs_ != nullptr) {
+            Slab* next = slabs_->next;
+            ::operator delete(slabs_, slabSize);
+            slabs_ = next;
+        }
+    }
+
+    FixedSizePool(const FixedSizePool&) = delete;
+    FixedSizePool& operator=(const FixedSizePool&) = delete;
+
+    [[nodiscard]] std::size_t nodeSize() const {
+        return nodeSize_;
+    }
+
+    [[nodiscard]] void* allocate() {
+        if (free_ != nullptr) {
+            FreeNode* node = free_;
+            free_ = node->next;
+            return node;
+        }
+
+        if (cur_ != end_) {
+            void* node = cur_;
+            cur_ += nodeSize_;
+            return node;
+        }
+
+        return refill();
+    }
+
+    void deallocate(void* p) noexcept {
+        auto* node = static_cast<FreeNode*>(p);
+        node->next = free_;
+        free_ = node;
+    }
+};
+
+// A FixedSizePool for each multiple of 16 bytes up to maxNodeSize, which is what
+// node based containers allocate, one node at a time. Anything bigger or more
+// aligned than that goes to the global heap.
+class NodePool {
+public:
+    static constexpr std::size_t granularity = 16;
+    static constexpr std::size_t maxNodeSize = 256;
+
+private:
+    static constexpr std::size_t classes = maxNodeSize / granularity;
+
+    std::array<FixedSizePool, classes> pools_ = []<std::size_t... I>(std::index_sequence<I...>) {
+        return std::array<FixedSizePool, classes>{FixedSizePool((I + 1) * granularity)...};
+    }(std::make_index_sequence<classes>{});
+
+    [[nodiscard]] static constexpr bool pooled(const std::size_t bytes, const std::size_t alignment) {
+        return bytes <= maxNodeSize && alignment <= granularity;
+    }
+
+public:
+    NodePool() = default;
+
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    [[nodiscard]] void* allocate(const std::size_t bytes, const std::size_t alignment) {
+        if (pooled(bytes, alignment))
+            return pools_[(std::max<std::size_t>(bytes, 1) - 1) / granularity].allocate();
+        return ::operator new(bytes, std::align_val_t{alignment});
+    }
+
+    void deallocate(void* p, const std::size_t bytes, const std::size_t alignment) noexcept {
+        if (pooled(bytes, alignment))
+            pools_[(std::max<std::size_t>(bytes, 1) - 1) / granularity].deallocate(p);
+        else
+            ::operator delete(p, bytes, std::align_val_t{alignment});
+    }
+};
+
+// The standard allocator interface over a NodePool, which must outlive it. A pool
+// is not thread safe, so neither is a container using it from several threads.
+template <typename T>
+struct NodePoolAllocator {
+    using value_type = T;
+
+    NodePool* pool;
+
+    explicit NodePoolAllocator(NodePool& p) noexcept : pool{&p} {}
+
+    template <typename U>
+    NodePoolAllocator(const NodePoolAllocator<U>& other) noexcept : pool{other.pool} {}
+
+    [[nodiscard]] T* allocate(std::size_t n) {
+        return static_cast<T*>(pool->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        pool->deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    template <typename U>
+    bool operator==(const NodePoolAllocator<U>& other) const noexcept {
+        return pool == other.pool;
+    }
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+// A range minimum structure that uses O(N) memory instead of the N*log(N) of the
+// SparseTable, while keeping O(1) queries.
+//
+// The array is cut into blocks of 64 elements. A SparseTable over the block minima
+// answers the whole blocks in a query, and the parts of a query inside a single
+// block are answered with a bitmask per element: bit k of masks_[i] is set if the
+// element at position k of the block is still on the monotonic stack after
+// pushing i. The leftmost set bit at or after l in masks_[r] is then the answer
+// for [l, r].
+
+#include "sparse-table.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+template <typename T, typename Compare = std::less<T>>
+class BlockRMQ {
+public:
+    static constexpr std::size_t blockSize = 64;
+
+private:
+    // Picks the best of two values according to Compare.
+    struct Pick {
+        Compare cmp{};
+
+        T operator()(const T& a, const T& b) const {
+            return cmp(b, a) ? b : a;
+        }
+    };
+
+    Pick pick_{};
+    const std::size_t maxN_;
+    const std::size_t blocks_{(maxN_ + blockSize - 1) / blockSize};
+
+    std::vector<T> data_ = std::vector<T>(maxN_);
+    std::vector<std::uint64_t> masks_ = std::vector<std::uint64_t>(maxN_);
+    SparseTable<T, Pick, true> blockTable_{pick_, blocks_};
+
+    [[nodiscard]] T inBlock(const std::size_t l, const std::size_t r) const {
+        const auto base = r - r % blockSize;
+        const auto m = masks_[r] & (~static_cast<std::uint64_t>(0) << (l - base));
+        return data_[base + static_cast<std::size_t>(std::countr_zero(m))];
+    }
+
+public:
+
+    explicit BlockRMQ(std::size_t maxN) : maxN_{maxN} {}
+    BlockRMQ(Compare cmp, std::size_t maxN) : pick_{cmp}, maxN_{maxN} {}
+
+    template <typename IT>
+    void precompute(IT first, IT last) {
+        std::copy(first, last, data_.begin());
+
+        std::vector<T> minima(blocks_);
+        for (std::size_t b = 0; b < blocks_; b++) {
+            const auto base = b * blockSize;
+            const auto end = std::min(base + blockSize, maxN_);
+
+            std::uint64_t stack = 0;
+            for (std::size_t i = base; i < end; i++) {
+                // Pop everything that is no better than the new element.
+                while (stack != 0) {
+                    const auto top = static_cast<std::size_t>(std::bit_width(stack) - 1);
+                    if (pick_.cmp(data_[base + top], data_[i]))
+                        break;
+
+                    stack ^= static_cast<std::uint64_t>(1) << top;
+                }
+
+                stack |= static_cast<std::uint64_t>(1) << (i - base);
+                masks_[i] = stack;
+            }
+
+            // The bottom of the stack is the best of the whole block.
+            minima[b] = data_[base + static_cast<std::size_t>(std::countr_zero(stack))];
+        }
+
+        blockTable_.precompute(minima.begin(), minima.end());
+    }
+
+    [[nodiscard]] T query(std::size_t l, const std::size_t r) const {
+        // we assume that l <= r
+        const auto bl = l / blockSize;
+        const auto br = r / blockSize;
+        if (bl == br)
+            return inBlock(l, r);
+
+        T ans = pick_(inBlock(l, bl*blockSize + blockSize - 1), inBlock(br*blockSize, r));
+        if (bl + 1 < br)
+            ans = pick_(ans, blockTable_.query(bl + 1, br - 1));
+
+        return ans;
+    }
+
+    // The number of bytes used for the structure itself.
+    [[nodiscard]] std::size_t bytes() const {
+        return data_.size() * sizeof(T) + masks_.size() * sizeof(std::uint64_t) + blockTable_.bytes();
+    }
+};
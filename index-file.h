@@ -0,0 +1,200 @@
+#pragma once
+
+// Read-only index files for the range structures, so that they can be built once
+// and then mmap'ed and queried in place on every start, instead of being
+// recomputed.
+//
+// A file is a 64 byte IndexFileHeader followed directly by the raw elements, so
+// the elements are as aligned as the mapping itself. There is no attempt at
+// portability, the files are meant to be read on the machine that wrote them.
+
+#include "sparse-table.h"
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct IndexFileHeader {
+    static constexpr std::uint64_t expectedMagic = 0x3130584449454d; // "MEIDX01"
+
+    enum class Kind : std::uint64_t {
+        SparseTable = 1,
+        PrefixSums = 2,
+    };
+
+    std::uint64_t magic{expectedMagic};
+    Kind kind{};
+    std::uint64_t elemSize{0};
+    std::uint64_t layout{0};
+    std::uint64_t n{0};
+    std::uint64_t count{0};
+    std::uint64_t reserved[2]{};
+};
+
+static_assert(sizeof(IndexFileHeader) == 64);
+
+// A read-only mapping of a whole file, which is unmapped when destroyed.
+class MappedFile {
+    void* addr_{nullptr};
+    std::size_t size_{0};
+
+public:
+    explicit MappedFile(const std::filesystem::path& path) {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::runtime_error("couldn't open index file: " + path.string());
+
+        struct stat st{};
+        if (::fstat(fd, &st) < 0) {
+            ::close(fd);
+            throw std::runtime_error("couldn't stat index file: " + path.string());
+        }
+
+        size_ = static_cast<std::size_t>(st.st_size);
+        addr_ = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        // The mapping keeps the file alive on its own.
+        ::close(fd);
+
+        if (addr_ == MAP_FAILED)
+            throw std::runtime_error("couldn't mmap index file: " + path.string());
+    }
+
+    ~MappedFile() {
+        if (addr_ != nullptr)
+            ::munmap(addr_, size_);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    [[nodiscard]] const std::byte* data() const {
+        return static_cast<const std::byte*>(addr_);
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return size_;
+    }
+};
+
+namespace detail {
+
+template <typename T>
+void writeIndexFile(const std::filesystem::path& path, const IndexFileHeader& header, std::span<const T> elems) {
+    static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be written raw");
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(elems.data()), static_cast<std::streamsize>(elems.size_bytes()));
+    if (!out)
+        throw std::runtime_error("couldn't write index file: " + path.string());
+}
+
+// Checks the header of a mapped file, and returns where the elements start.
+template <typename T>
+const T* checkIndexFile(const MappedFile& file, IndexFileHeader::Kind kind, std::uint64_t layout,
+                        std::uint64_t n, std::uint64_t count) {
+    if (file.size() < sizeof(IndexFileHeader))
+        throw std::runtime_error("index file is too small to have a header");
+
+    IndexFileHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+
+    if (header.magic != IndexFileHeader::expectedMagic)
+        throw std::runtime_error("index file has the wrong magic");
+    if (header.kind != kind || header.elemSize != sizeof(T) || header.layout != layout)
+        throw std::runtime_error("index file doesn't hold the structure we expected");
+    if (header.n != n || header.count != count)
+        throw std::runtime_error("index file has the wrong dimensions");
+    if (file.size() < sizeof(IndexFileHeader) + count * sizeof(T))
+        throw std::runtime_error("index file is truncated");
+
+    return reinterpret_cast<const T*>(file.data() + sizeof(IndexFileHeader));
+}
+
+}
+
+template <typename T, typename F, bool IDEMPOTENT, typename Layout, typename Alloc>
+void writeIndexFile(const std::filesystem::path& path, const SparseTable<T, F, IDEMPOTENT, Layout, Alloc>& table) {
+    const auto raw = table.raw();
+
+    IndexFileHeader header;
+    header.kind = IndexFileHeader::Kind::SparseTable;
+    header.elemSize = sizeof(T);
+    header.layout = Layout::fileTag;
+    header.n = table.maxN();
+    header.count = raw.size();
+
+    detail::writeIndexFile(path, header, raw);
+}
+
+// Writes the prefix sums of [first, last), with the leading 0, to path.
+template <typename T, typename IT>
+void writePrefixSumsFile(const std::filesystem::path& path, IT first, IT last) {
+    std::vector<T> psa{T{}};
+    for (; first != last; ++first)
+        psa.push_back(psa.back() + *first);
+
+    IndexFileHeader header;
+    header.kind = IndexFileHeader::Kind::PrefixSums;
+    header.elemSize = sizeof(T);
+    header.n = psa.size() - 1;
+    header.count = psa.size();
+
+    detail::writeIndexFile(path, header, std::span<const T>(psa));
+}
+
+// A SparseTable that is queried directly from a file written by writeIndexFile.
+template <typename T, typename F, bool IDEMPOTENT = false, typename Layout = LevelMajorLayout>
+class MappedSparseTable {
+    F func_{};
+    const std::size_t maxN_;
+    const std::size_t maxK_{static_cast<std::size_t>(std::bit_width(maxN_)-1)};
+    const Layout layout_{maxK_+1, maxN_+1};
+
+    MappedFile file_;
+    const T* data_{detail::checkIndexFile<T>(file_, IndexFileHeader::Kind::SparseTable, Layout::fileTag,
+                                             maxN_, layout_.rows() * layout_.columns())};
+
+    [[nodiscard]] const T& at(std::size_t level, std::size_t pos) const {
+        return data_[layout_.row(level, pos) * layout_.columns() + layout_.column(level, pos)];
+    }
+
+public:
+    MappedSparseTable(const std::filesystem::path& path, std::size_t maxN) : maxN_{maxN}, file_{path} {}
+    MappedSparseTable(F fn, const std::filesystem::path& path, std::size_t maxN)
+        : func_{fn}, maxN_{maxN}, file_{path} {}
+
+    [[nodiscard]] T query(std::size_t l, const std::size_t r) const {
+        return sparseTableQuery<IDEMPOTENT, T>(func_, maxK_, [this](std::size_t i, std::size_t j) -> const T& {
+            return at(i, j);
+        }, l, r);
+    }
+};
+
+// Prefix sums queried directly from a file written by writePrefixSumsFile.
+template <typename T>
+class MappedPrefixSums {
+    const std::size_t maxN_;
+
+    MappedFile file_;
+    const T* psa_{detail::checkIndexFile<T>(file_, IndexFileHeader::Kind::PrefixSums, 0, maxN_, maxN_ + 1)};
+
+public:
+    MappedPrefixSums(const std::filesystem::path& path, std::size_t maxN) : maxN_{maxN}, file_{path} {}
+
+    [[nodiscard]] T query(std::size_t l, const std::size_t r) const {
+        // we assume that l <= r
+        return psa_[r + 1] - psa_[l];
+    }
+};
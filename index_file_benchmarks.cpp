@@ -0,0 +1,193 @@
+#include <benchmark/benchmark.h>
+
+#include "alloc-counters.h"
+#include "index-file.h"
+#include "sparse-table.h"
+#include <chrono>
+#include <cinttypes>
+#include <filesystem>
+#include <random>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// These compare what it costs to get from nothing to the first answer, either by
+// computing the structure or by mapping a file written earlier. Between the
+// iterations we drop the file from the page cache, so the mapping has to fault
+// everything it touches in from disk. As that is mostly waiting, we use real time.
+
+static std::filesystem::path indexPath(const std::string& name, std::size_t n) {
+    return std::filesystem::temp_directory_path() / ("measure_everything_" + name + "_" + std::to_string(n) + ".idx");
+}
+
+static void dropFromPageCache(const std::filesystem::path& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+
+    ::fdatasync(fd);
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+}
+
+static std::vector<std::int64_t> makeInput(std::size_t maxN) {
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<std::int64_t> vals(1, 10000);
+
+    std::vector<std::int64_t> cool(maxN);
+    for (std::size_t i = 0; i < maxN; i++)
+        cool[i] = vals(gen);
+
+    return cool;
+}
+
+static void BM_indexFile_coldStart_precompute_SparseTable(benchmark::State& state) {
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+
+    using T = std::int64_t;
+    auto f = [](const T a, const T b) { return std::min(a, b); };
+
+    const auto cool = makeInput(maxN);
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<std::size_t> queryDist(0, maxN-1);
+    std::chrono::duration<double, std::nano> firstQuery{0};
+    const CountAllocations allocations(state, AllocationsPer::Iteration);
+    for (auto _ : state) {
+        SparseTable<T, decltype(f), true> st(maxN);
+        st.precompute(cool.begin(), cool.end());
+
+        auto l = queryDist(gen);
+        auto r = queryDist(gen);
+        if (r < l)
+            std::swap(r, l);
+
+        const auto beginTS = std::chrono::steady_clock::now();
+        T ans = st.query(l, r);
+        benchmark::DoNotOptimize(ans);
+        firstQuery += std::chrono::steady_clock::now() - beginTS;
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["first_query_ns"] = benchmark::Counter(firstQuery.count(), benchmark::Counter::kAvgIterations);
+}
+
+static void BM_indexFile_coldStart_mmap_SparseTable(benchmark::State& state) {
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+
+    using T = std::int64_t;
+    auto f = [](const T a, const T b) { return std::min(a, b); };
+
+    const auto path = indexPath("sparse_table", maxN);
+    {
+        const auto cool = makeInput(maxN);
+        SparseTable<T, decltype(f), true> st(maxN);
+        st.precompute(cool.begin(), cool.end());
+        writeIndexFile(path, st);
+    }
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<std::size_t> queryDist(0, maxN-1);
+    std::chrono::duration<double, std::nano> firstQuery{0};
+    const CountAllocations allocations(state, AllocationsPer::Iteration);
+    for (auto _ : state) {
+        state.PauseTiming();
+        dropFromPageCache(path);
+        state.ResumeTiming();
+
+        MappedSparseTable<T, decltype(f), true> st(path, maxN);
+
+        auto l = queryDist(gen);
+        auto r = queryDist(gen);
+        if (r < l)
+            std::swap(r, l);
+
+        const auto beginTS = std::chrono::steady_clock::now();
+        T ans = st.query(l, r);
+        benchmark::DoNotOptimize(ans);
+        firstQuery += std::chrono::steady_clock::now() - beginTS;
+    }
+
+    std::filesystem::remove(path);
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["first_query_ns"] = benchmark::Counter(firstQuery.count(), benchmark::Counter::kAvgIterations);
+}
+
+static void BM_indexFile_coldStart_precompute_PSA(benchmark::State& state) {
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+
+    using T = std::int64_t;
+
+    const auto cool = makeInput(maxN);
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<std::size_t> queryDist(0, maxN-1);
+    std::chrono::duration<double, std::nano> firstQuery{0};
+    const CountAllocations allocations(state, AllocationsPer::Iteration);
+    for (auto _ : state) {
+        std::vector<T> psa(maxN+1);
+        for (std::size_t i = 0; i < maxN; i++) {
+            psa[i+1] = psa[i] + cool[i];
+        }
+
+        auto l = queryDist(gen);
+        auto r = queryDist(gen);
+        if (r < l)
+            std::swap(r, l);
+
+        const auto beginTS = std::chrono::steady_clock::now();
+        T ans = psa[r+1] - psa[l];
+        benchmark::DoNotOptimize(ans);
+        firstQuery += std::chrono::steady_clock::now() - beginTS;
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["first_query_ns"] = benchmark::Counter(firstQuery.count(), benchmark::Counter::kAvgIterations);
+}
+
+static void BM_indexFile_coldStart_mmap_PSA(benchmark::State& state) {
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+
+    using T = std::int64_t;
+
+    const auto path = indexPath("psa", maxN);
+    {
+        const auto cool = makeInput(maxN);
+        writePrefixSumsFile<T>(path, cool.begin(), cool.end());
+    }
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<std::size_t> queryDist(0, maxN-1);
+    std::chrono::duration<double, std::nano> firstQuery{0};
+    const CountAllocations allocations(state, AllocationsPer::Iteration);
+    for (auto _ : state) {
+        state.PauseTiming();
+        dropFromPageCache(path);
+        state.ResumeTiming();
+
+        MappedPrefixSums<T> psa(path, maxN);
+
+        auto l = queryDist(gen);
+        auto r = queryDist(gen);
+        if (r < l)
+            std::swap(r, l);
+
+        const auto beginTS = std::chrono::steady_clock::now();
+        T ans = psa.query(l, r);
+        benchmark::DoNotOptimize(ans);
+        firstQuery += std::chrono::steady_clock::now() - beginTS;
+    }
+
+    std::filesystem::remove(path);
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["first_query_ns"] = benchmark::Counter(firstQuery.count(), benchmark::Counter::kAvgIterations);
+}
+
+// The sparse table is N*log(N), so at 1<<24 it is already over 3GB on disk.
+BENCHMARK(BM_indexFile_coldStart_precompute_SparseTable)->RangeMultiplier(4)->Range(1<<20, 1<<24)->UseRealTime();
+BENCHMARK(BM_indexFile_coldStart_mmap_SparseTable)->RangeMultiplier(4)->Range(1<<20, 1<<24)->UseRealTime();
+BENCHMARK(BM_indexFile_coldStart_precompute_PSA)->RangeMultiplier(4)->Range(1<<20, 1<<28)->UseRealTime();
+BENCHMARK(BM_indexFile_coldStart_mmap_PSA)->RangeMultiplier(4)->Range(1<<20, 1<<28)->UseRealTime();
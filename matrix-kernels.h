@@ -0,0 +1,182 @@
+#pragma once
+
+// Dense matrix kernels on Vector2D, written to be kind to the cache and to the
+// auto-vectorizer, rather than as the textbook loops.
+//
+// The compiler is not allowed to reorder floating point additions, so a plain
+// reduction loop stays scalar. Where we reduce, we do it into Lanes independent
+// accumulators ourselves, which gives the vectorizer the freedom it needs.
+// Note that this means the results can differ in the last bits from the naive loops.
+
+#include "vector2d.h"
+
+#include <algorithm>
+#include <array>
+#include <span>
+#include <stdexcept>
+
+namespace detail {
+
+// Enough for 8 floats or 4 doubles per register, times two for latency.
+constexpr std::size_t Lanes = 16;
+
+template <typename T, typename F>
+[[nodiscard]] T reduceLanes(const T* data, std::size_t n, T identity, F f) {
+    std::array<T, Lanes> acc{};
+    acc.fill(identity);
+
+    std::size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes)
+        for (std::size_t k = 0; k < Lanes; k++)
+            acc[k] = f(acc[k], data[i + k]);
+
+    for (; i < n; i++)
+        acc[0] = f(acc[0], data[i]);
+
+    T ans = identity;
+    for (const auto x : acc)
+        ans = f(ans, x);
+
+    return ans;
+}
+
+template <typename T>
+[[nodiscard]] T dot(const T* a, const T* b, std::size_t n) {
+    std::array<T, Lanes> acc{};
+
+    std::size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes)
+        for (std::size_t k = 0; k < Lanes; k++)
+            acc[k] += a[i + k] * b[i + k];
+
+    for (; i < n; i++)
+        acc[0] += a[i] * b[i];
+
+    T ans{};
+    for (const auto x : acc)
+        ans += x;
+
+    return ans;
+}
+
+template <typename T, typename AllocIn, typename AllocOut>
+void transposeRecursive(const Vector2D<T, AllocIn>& in, Vector2D<T, AllocOut>& out,
+                        std::size_t r0, std::size_t r1, std::size_t c0, std::size_t c1) {
+    // Small enough to sit in L1, both ways.
+    constexpr std::size_t leaf = 16;
+
+    if (r1 - r0 <= leaf && c1 - c0 <= leaf) {
+        for (std::size_t r = r0; r < r1; r++)
+            for (std::size_t c = c0; c < c1; c++)
+                out.get(c, r) = in.get(r, c);
+    } else if (c1 - c0 < r1 - r0) {
+        const auto mid = r0 + (r1 - r0) / 2;
+        transposeRecursive(in, out, r0, mid, c0, c1);
+        transposeRecursive(in, out, mid, r1, c0, c1);
+    } else {
+        const auto mid = c0 + (c1 - c0) / 2;
+        transposeRecursive(in, out, r0, r1, c0, mid);
+        transposeRecursive(in, out, r0, r1, mid, c1);
+    }
+}
+
+template <typename T, typename AllocIn, typename AllocOut>
+void checkTransposeShape(const Vector2D<T, AllocIn>& in, const Vector2D<T, AllocOut>& out) {
+    if (in.rows() != out.columns() || in.columns() != out.rows())
+        throw std::runtime_error("the output of a transpose must be columns x rows of the input");
+}
+
+}
+
+// Transposes in into out, one BlockSize x BlockSize tile at a time, so that both
+// the rows we read and the rows we write stay in cache for the whole tile.
+template <std::size_t BlockSize = 32, typename T, typename AllocIn, typename AllocOut>
+void transposeBlocked(const Vector2D<T, AllocIn>& in, Vector2D<T, AllocOut>& out) {
+    detail::checkTransposeShape(in, out);
+
+    for (std::size_t rb = 0; rb < in.rows(); rb += BlockSize) {
+        const auto rEnd = std::min(rb + BlockSize, in.rows());
+        for (std::size_t cb = 0; cb < in.columns(); cb += BlockSize) {
+            const auto cEnd = std::min(cb + BlockSize, in.columns());
+            for (std::size_t r = rb; r < rEnd; r++)
+                for (std::size_t c = cb; c < cEnd; c++)
+                    out.get(c, r) = in.get(r, c);
+        }
+    }
+}
+
+// Transposes in into out by splitting the longest side in two until the pieces
+// are tiny, which makes it cache friendly without knowing the cache sizes.
+template <typename T, typename AllocIn, typename AllocOut>
+void transposeRecursive(const Vector2D<T, AllocIn>& in, Vector2D<T, AllocOut>& out) {
+    detail::checkTransposeShape(in, out);
+    detail::transposeRecursive(in, out, 0, in.rows(), 0, in.columns());
+}
+
+// y = a * x
+template <typename T, typename Alloc>
+void matVec(const Vector2D<T, Alloc>& a, std::span<const T> x, std::span<T> y) {
+    if (x.size() != a.columns() || y.size() != a.rows())
+        throw std::runtime_error("matVec needs x to have columns and y rows elements");
+
+    for (std::size_t r = 0; r < a.rows(); r++)
+        y[r] = detail::dot(a.row(r).data(), x.data(), a.columns());
+}
+
+// c = a * b. We go through the tiles in i-k-j order, so the innermost loop is an
+// axpy of a row of b into a row of c, which needs no reduction and vectorizes
+// as is.
+template <std::size_t BlockSize = 64, typename T, typename AllocA, typename AllocB, typename AllocC>
+void matMulBlocked(const Vector2D<T, AllocA>& a, const Vector2D<T, AllocB>& b, Vector2D<T, AllocC>& c) {
+    if (a.columns() != b.rows() || c.rows() != a.rows() || c.columns() != b.columns())
+        throw std::runtime_error("matMul needs a to be n x m, b m x p and c n x p");
+
+    for (std::size_t r = 0; r < c.rows(); r++)
+        std::fill(c.row(r).begin(), c.row(r).end(), T{});
+
+    for (std::size_t ib = 0; ib < a.rows(); ib += BlockSize) {
+        const auto iEnd = std::min(ib + BlockSize, a.rows());
+        for (std::size_t kb = 0; kb < a.columns(); kb += BlockSize) {
+            const auto kEnd = std::min(kb + BlockSize, a.columns());
+            for (std::size_t jb = 0; jb < b.columns(); jb += BlockSize) {
+                const auto jEnd = std::min(jb + BlockSize, b.columns());
+
+                for (std::size_t i = ib; i < iEnd; i++) {
+                    T* cRow = c.row(i).data();
+                    for (std::size_t k = kb; k < kEnd; k++) {
+                        const T aik = a.get(i, k);
+                        const T* bRow = b.row(k).data();
+                        for (std::size_t j = jb; j < jEnd; j++)
+                            cRow[j] += aik * bRow[j];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Applies f to every element of in, writing the result to the same place in out.
+template <typename T, typename U, typename AllocIn, typename AllocOut, typename F>
+void mapElements(const Vector2D<T, AllocIn>& in, Vector2D<U, AllocOut>& out, F f) {
+    if (in.rows() != out.rows() || in.columns() != out.columns())
+        throw std::runtime_error("mapElements needs the input and output to be the same shape");
+
+    for (std::size_t r = 0; r < in.rows(); r++) {
+        const T* src = in.row(r).data();
+        U* dst = out.row(r).data();
+        for (std::size_t c = 0; c < in.columns(); c++)
+            dst[c] = f(src[c]);
+    }
+}
+
+// Folds every element together with f, which has to be associative and commutative,
+// as we split the work over independent lanes. identity must be the identity of f,
+// such as 0 for a sum, as every lane starts from it.
+template <typename T, typename Alloc, typename F>
+[[nodiscard]] T reduceElements(const Vector2D<T, Alloc>& in, T identity, F f) {
+    T ans = identity;
+    for (std::size_t r = 0; r < in.rows(); r++)
+        ans = f(ans, detail::reduceLanes(in.row(r).data(), in.columns(), identity, f));
+
+    return ans;
+}
@@ -6,11 +6,27 @@
 
 #include <mimalloc.h>
 // #include <mimalloc-new-delete.h>
-#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <fstream>
 #include <iostream>
 #include <list>
+#include <map>
+#include <memory_resource>
 #include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
+#include <malloc.h>
+
+#include "../alloc-counters.h"
+#include "../allocators.h"
+#include "../sparse-table.h"
+#include "../mthreads/AtomicSPSC.h"
 
 #include "../third_party/pcg_random.hpp"
 #include "../third_party/pcg_extras.hpp"
@@ -18,55 +34,506 @@
 
 static pcg64_fast rng(pcg_extras::static_arbitrary_seed<std::uint64_t>::value);
 
+// Counts the allocations made through Alloc into allocationStats, and otherwise just
+// passes them on. We count here rather than in operator new, as most of the
+// allocators we compare never go through it.
 template <typename Alloc>
-static void allocTest(const Alloc& alloc) {
-    using UT = std::uint64_t;
-
-    std::bernoulli_distribution d(0.4);
-
-    std::list<UT, std::decay_t<decltype(alloc)>> ls(alloc);
-    for (std::size_t i = 0; i < 10'000'000; i++) {
-        if (d(rng)) {
-            if (!ls.empty())
-                ls.pop_front();
-        } else {
-            ls.push_front(i);
+struct CountingAllocator {
+    using value_type = typename Alloc::value_type;
+
+    Alloc alloc;
+
+    explicit CountingAllocator(Alloc a) : alloc{std::move(a)} {}
+
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U>& other) : alloc{Alloc(other.alloc)} {}
+
+    template <typename T>
+    struct rebind {
+        using other = CountingAllocator<typename std::allocator_traits<Alloc>::template rebind_alloc<T>>;
+    };
+
+    [[nodiscard]] value_type* allocate(std::size_t n) {
+        countAllocation(n * sizeof(value_type));
+        return std::allocator_traits<Alloc>::allocate(alloc, n);
+    }
+
+    void deallocate(value_type* p, std::size_t n) {
+        countDeallocation(n * sizeof(value_type));
+        std::allocator_traits<Alloc>::deallocate(alloc, p, n);
+    }
+
+    template <typename U>
+    bool operator==(const CountingAllocator<U>& other) const {
+        return alloc == other.alloc;
+    }
+};
+
+// The allocators we compare. Each is set up fresh for every iteration, and hands
+// out an allocator for any type with get<T>(), all sharing the same heap, arena or
+// resource.
+
+struct StdAlloc {
+    template <typename T>
+    std::allocator<T> get() {
+        return {};
+    }
+};
+
+struct MiAlloc {
+    template <typename T>
+    mi_stl_allocator<T> get() {
+        return {};
+    }
+};
+
+struct MiHeapAlloc {
+    mi_heap_stl_allocator<std::byte> heap;
+
+    template <typename T>
+    mi_heap_stl_allocator<T> get() {
+        return mi_heap_stl_allocator<T>(heap);
+    }
+};
+
+struct MiHeapDestroyAlloc {
+    mi_heap_destroy_stl_allocator<std::byte> heap;
+
+    template <typename T>
+    mi_heap_destroy_stl_allocator<T> get() {
+        return mi_heap_destroy_stl_allocator<T>(heap);
+    }
+};
+
+struct MonotonicAlloc {
+    std::pmr::monotonic_buffer_resource resource;
+
+    template <typename T>
+    std::pmr::polymorphic_allocator<T> get() {
+        return std::pmr::polymorphic_allocator<T>(&resource);
+    }
+};
+
+struct PoolAlloc {
+    std::pmr::unsynchronized_pool_resource resource;
+
+    template <typename T>
+    std::pmr::polymorphic_allocator<T> get() {
+        return std::pmr::polymorphic_allocator<T>(&resource);
+    }
+};
+
+struct BumpAlloc {
+    BumpArena arena;
+
+    template <typename T>
+    BumpAllocator<T> get() {
+        return BumpAllocator<T>(arena);
+    }
+};
+
+// The unsynchronized PoolAlloc can't be freed to from another thread, this one can.
+struct SyncPoolAlloc {
+    std::pmr::synchronized_pool_resource resource;
+
+    template <typename T>
+    std::pmr::polymorphic_allocator<T> get() {
+        return std::pmr::polymorphic_allocator<T>(&resource);
+    }
+};
+
+struct NodePoolAlloc {
+    NodePool pool;
+
+    template <typename T>
+    NodePoolAllocator<T> get() {
+        return NodePoolAllocator<T>(pool);
+    }
+};
+
+template <typename Allocs, typename T>
+using AllocOf = CountingAllocator<decltype(std::declval<Allocs&>().template get<T>())>;
+
+template <typename T, typename Allocs>
+AllocOf<Allocs, T> allocFor(Allocs& allocs) {
+    return AllocOf<Allocs, T>(allocs.template get<T>());
+}
+
+// The workloads, each a pattern of allocations that is common in our code.
+
+// Pushes to and pops from the front of a list at random, which keeps it short but
+// allocates and frees a node for nearly every operation.
+struct ListChurn {
+    template <typename Allocs>
+    static void run(Allocs& allocs) {
+        using UT = std::uint64_t;
+
+        std::bernoulli_distribution d(0.4);
+
+        std::list<UT, AllocOf<Allocs, UT>> ls(allocFor<UT>(allocs));
+        for (std::size_t i = 0; i < 10'000'000; i++) {
+            if (d(rng)) {
+                if (!ls.empty())
+                    ls.pop_front();
+            } else {
+                ls.push_front(i);
+            }
+        }
+
+        benchmark::DoNotOptimize(ls.size());
+    }
+};
+
+// Inserts and erases random keys in a map, which is the same node churn, but with
+// the nodes spread all over a tree that is a lot bigger.
+struct MapChurn {
+    template <typename Allocs>
+    static void run(Allocs& allocs) {
+        using UT = std::uint64_t;
+
+        std::bernoulli_distribution d(0.4);
+        std::uniform_int_distribution<UT> keys(0, 1 << 16);
+
+        std::map<UT, UT, std::less<>, AllocOf<Allocs, std::pair<const UT, UT>>> m(allocFor<std::pair<const UT, UT>>(allocs));
+        for (std::size_t i = 0; i < 2'000'000; i++) {
+            if (d(rng)) {
+                m.erase(keys(rng));
+            } else {
+                m.emplace(keys(rng), i);
+            }
         }
+
+        benchmark::DoNotOptimize(m.size());
+    }
+};
+
+// Grows many vectors one element at a time, so that they are reallocated over and
+// over, with the old buffers freed as we go.
+struct VectorGrowth {
+    template <typename Allocs>
+    static void run(Allocs& allocs) {
+        using UT = std::uint64_t;
+
+        std::size_t total = 0;
+        for (std::size_t r = 0; r < 1'000; r++) {
+            std::vector<UT, AllocOf<Allocs, UT>> vec(allocFor<UT>(allocs));
+            for (std::size_t i = 0; i < 10'000; i++)
+                vec.push_back(i);
+            total += vec.size();
+        }
+
+        benchmark::DoNotOptimize(total);
     }
+};
 
-    benchmark::DoNotOptimize(ls.size());
+// Builds a lot of strings that are just too long for the small string optimization,
+// and drops them all at the end.
+struct SmallStrings {
+    template <typename Allocs>
+    static void run(Allocs& allocs) {
+        using String = std::basic_string<char, std::char_traits<char>, AllocOf<Allocs, char>>;
+        static const std::string text(64, 'x');
+
+        std::uniform_int_distribution<std::size_t> lengths(16, 63);
+
+        std::vector<String, AllocOf<Allocs, String>> strings(allocFor<String>(allocs));
+        strings.reserve(1'000'000);
+        for (std::size_t i = 0; i < 1'000'000; i++)
+            strings.emplace_back(text.data(), lengths(rng), allocFor<char>(allocs));
+
+        benchmark::DoNotOptimize(strings.size());
+    }
+};
+
+// A query session of our service: builds sparse tables over a few arrays of
+// different sizes, answers a batch of queries on each, and drops them all at the
+// end. With an arena, the whole session is released in one go.
+struct SparseTableSession {
+    template <typename Allocs>
+    static void run(Allocs& allocs) {
+        using UT = std::uint64_t;
+        constexpr std::size_t tableCount = 8;
+        constexpr std::size_t queryCount = 10'000;
+
+        auto f = [](const UT a, const UT b) { return std::min(a, b); };
+        using Table = SparseTable<UT, decltype(f), true, LevelMajorLayout, AllocOf<Allocs, UT>>;
+
+        std::uniform_int_distribution<std::size_t> sizes(1 << 12, 1 << 15);
+        std::uniform_int_distribution<UT> vals(0, 1'000'000);
+
+        std::vector<Table, AllocOf<Allocs, Table>> tables(allocFor<Table>(allocs));
+        tables.reserve(tableCount);
+        for (std::size_t t = 0; t < tableCount; t++) {
+            std::vector<UT, AllocOf<Allocs, UT>> values(sizes(rng), allocFor<UT>(allocs));
+            for (auto& v : values)
+                v = vals(rng);
+
+            tables.emplace_back(f, values.size(), allocFor<UT>(allocs));
+            tables.back().precompute(values.begin(), values.end());
+        }
+
+        UT sum = 0;
+        for (const auto& table : tables) {
+            std::uniform_int_distribution<std::size_t> positions(0, table.maxN() - 1);
+            for (std::size_t q = 0; q < queryCount; q++) {
+                auto l = positions(rng);
+                auto r = positions(rng);
+                if (r < l)
+                    std::swap(l, r);
+                sum += table.query(l, r);
+            }
+        }
+
+        benchmark::DoNotOptimize(sum);
+    }
+};
+
+// Reads a size in kB, like VmRSS, from /proc/self/status, and returns it in bytes.
+static std::size_t statusBytes(const std::string& field) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.starts_with(field + ":"))
+            return std::stoull(line.substr(field.size() + 1)) * 1024;
+    }
+    return 0;
+}
+
+// The peak RSS of the process, since the last resetPeakRss.
+static std::size_t peakRss() {
+    return statusBytes("VmHWM");
+}
+
+static std::size_t currentRss() {
+    return statusBytes("VmRSS");
+}
+
+// Gives back what the allocators are holding on to from the benchmarks before us,
+// and resets the peak RSS to what we use now, so that we only see our own peak.
+// The reset needs Linux 4.0, before that it's the peak since the start. What the
+// allocators don't give back is still counted, which is why we report the growth
+// over where we started as well.
+static void resetPeakRss() {
+    mi_collect(true);
+    malloc_trim(0);
+    std::ofstream("/proc/self/clear_refs") << "5";
 }
 
-// Figure out some workload I think could be affected by using a heap and a non heap allocator?
-static void BM_normalAlloc(benchmark::State& state) {
+template <typename Allocs, typename Workload>
+static void BM_allocator(benchmark::State& state) {
     rng.seed(10);
+    resetPeakRss();
+    const auto startRss = currentRss();
+    const auto startAllocs = allocationStats.allocs;
+
+    const CountAllocations allocations(state, AllocationsPer::Iteration);
     for (auto _ : state) {
-        mi_stl_allocator<std::uint64_t> ourAlloc;
-        allocTest(ourAlloc);
+        Allocs allocs;
+        Workload::run(allocs);
     }
+
+    state.counters["allocs_per_sec"] = benchmark::Counter(static_cast<double>(allocationStats.allocs - startAllocs), benchmark::Counter::kIsRate);
+    const auto peak = peakRss();
+    state.counters["peak_rss_mb"] = static_cast<double>(peak) / (1 << 20);
+    state.counters["peak_rss_growth_mb"] = static_cast<double>(peak - std::min(peak, startRss)) / (1 << 20);
 }
 
-// Figure out some workload I think could be affected by using a heap and a non heap allocator?
-static void BM_heapAlloc(benchmark::State& state) {
+BENCHMARK_TEMPLATE(BM_allocator, StdAlloc, ListChurn);
+BENCHMARK_TEMPLATE(BM_allocator, MiAlloc, ListChurn);
+BENCHMARK_TEMPLATE(BM_allocator, MiHeapAlloc, ListChurn);
+BENCHMARK_TEMPLATE(BM_allocator, MiHeapDestroyAlloc, ListChurn);
+BENCHMARK_TEMPLATE(BM_allocator, MonotonicAlloc, ListChurn);
+BENCHMARK_TEMPLATE(BM_allocator, PoolAlloc, ListChurn);
+BENCHMARK_TEMPLATE(BM_allocator, BumpAlloc, ListChurn);
+BENCHMARK_TEMPLATE(BM_allocator, NodePoolAlloc, ListChurn);
+
+BENCHMARK_TEMPLATE(BM_allocator, StdAlloc, MapChurn);
+BENCHMARK_TEMPLATE(BM_allocator, MiAlloc, MapChurn);
+BENCHMARK_TEMPLATE(BM_allocator, MiHeapAlloc, MapChurn);
+BENCHMARK_TEMPLATE(BM_allocator, MiHeapDestroyAlloc, MapChurn);
+BENCHMARK_TEMPLATE(BM_allocator, MonotonicAlloc, MapChurn);
+BENCHMARK_TEMPLATE(BM_allocator, PoolAlloc, MapChurn);
+BENCHMARK_TEMPLATE(BM_allocator, BumpAlloc, MapChurn);
+BENCHMARK_TEMPLATE(BM_allocator, NodePoolAlloc, MapChurn);
+
+BENCHMARK_TEMPLATE(BM_allocator, StdAlloc, VectorGrowth);
+BENCHMARK_TEMPLATE(BM_allocator, MiAlloc, VectorGrowth);
+BENCHMARK_TEMPLATE(BM_allocator, MiHeapAlloc, VectorGrowth);
+BENCHMARK_TEMPLATE(BM_allocator, MiHeapDestroyAlloc, VectorGrowth);
+BENCHMARK_TEMPLATE(BM_allocator, MonotonicAlloc, VectorGrowth);
+BENCHMARK_TEMPLATE(BM_allocator, PoolAlloc, VectorGrowth);
+BENCHMARK_TEMPLATE(BM_allocator, BumpAlloc, VectorGrowth);
+BENCHMARK_TEMPLATE(BM_allocator, NodePoolAlloc, VectorGrowth);
+
+BENCHMARK_TEMPLATE(BM_allocator, StdAlloc, SmallStrings);
+BENCHMARK_TEMPLATE(BM_allocator, MiAlloc, SmallStrings);
+BENCHMARK_TEMPLATE(BM_allocator, MiHeapAlloc, SmallStrings);
+BENCHMARK_TEMPLATE(BM_allocator, MiHeapDestroyAlloc, SmallStrings);
+BENCHMARK_TEMPLATE(BM_allocator, MonotonicAlloc, SmallStrings);
+BENCHMARK_TEMPLATE(BM_allocator, PoolAlloc, SmallStrings);
+BENCHMARK_TEMPLATE(BM_allocator, BumpAlloc, SmallStrings);
+BENCHMARK_TEMPLATE(BM_allocator, NodePoolAlloc, SmallStrings);
+
+BENCHMARK_TEMPLATE(BM_allocator, StdAlloc, SparseTableSession);
+BENCHMARK_TEMPLATE(BM_allocator, MiAlloc, SparseTableSession);
+BENCHMARK_TEMPLATE(BM_allocator, MiHeapAlloc, SparseTableSession);
+BENCHMARK_TEMPLATE(BM_allocator, MiHeapDestroyAlloc, SparseTableSession);
+BENCHMARK_TEMPLATE(BM_allocator, MonotonicAlloc, SparseTableSession);
+BENCHMARK_TEMPLATE(BM_allocator, PoolAlloc, SparseTableSession);
+BENCHMARK_TEMPLATE(BM_allocator, BumpAlloc, SparseTableSession);
+BENCHMARK_TEMPLATE(BM_allocator, NodePoolAlloc, SparseTableSession);
+
+// A buffer on its way to the consumer thread, or back.
+struct Buffer {
+    std::byte* data;
+    std::size_t size;
+};
+
+using BufferFifo = AtomicSPSCFifo<Buffer, 1024, std::allocator<Buffer>, HybridWait<>>;
+
+enum class FreeOn { Producer, Consumer };
+
+// Allocates count buffers of random sizes on this thread and sends them through a
+// fifo to a consumer thread, which sends them back. With FreeOn::Consumer, the
+// consumer frees them and only sends back that it has, otherwise we free them here
+// when they come back. Both do the same work on the fifos, so the difference in
+// time between them is what freeing on another thread costs.
+template <FreeOn Where, typename Allocs>
+static std::chrono::duration<double> crossThreadPass(Allocs& allocs, const std::size_t count) {
+    auto alloc = allocFor<std::byte>(allocs);
+    std::uniform_int_distribution<std::size_t> sizes(16, 1024);
+    BufferFifo there;
+    BufferFifo back;
+
+    const auto beginTS = std::chrono::steady_clock::now();
+
+    // alloc is shared rather than copied, so that a mi_heap is never dropped by the
+    // consumer, as only the thread owning it may delete it.
+    std::thread consumer([&there, &back, &alloc, count]() {
+        for (std::size_t i = 0; i < count; i++) {
+            auto buf = there.pop();
+            if constexpr (Where == FreeOn::Consumer) {
+                alloc.deallocate(buf.data, buf.size);
+                buf.data = nullptr;
+            }
+            back.push(buf);
+        }
+    });
+
+    std::size_t returned = 0;
+    // A buffer the consumer freed is counted as freed on its thread, so we count it
+    // here too once it is acked, or the stats of this thread would only ever grow.
+    const auto takeBack = [&alloc, &returned](const Buffer& buf) {
+        if constexpr (Where == FreeOn::Producer)
+            alloc.deallocate(buf.data, buf.size);
+        else
+            countDeallocation(buf.size);
+        returned++;
+    };
+
+    for (std::size_t i = 0; i < count; i++) {
+        const auto size = sizes(rng);
+        const Buffer buf{alloc.allocate(size), size};
+        std::fill_n(buf.data, 16, std::byte{1});
+
+        // We must keep taking buffers back while we wait, or the consumer can end up
+        // waiting for us to make room in back.
+        while (!there.try_push(buf)) {
+            while (const auto done = back.try_pop())
+                takeBack(*done);
+        }
+        while (const auto done = back.try_pop())
+            takeBack(*done);
+    }
+    while (returned < count)
+        takeBack(back.pop());
+
+    consumer.join();
+    return std::chrono::steady_clock::now() - beginTS;
+}
+
+// The time of a benchmark is that of the remote frees, and remote_free_ns is what
+// each of them cost over freeing on the thread that allocated. The allocations are
+// counted on the producer, for both passes of an iteration, and peak_bytes is the
+// most that was in flight at once.
+template <typename Allocs>
+static void BM_crossThreadFree(benchmark::State& state) {
+    constexpr std::size_t count = 1'000'000;
+
     rng.seed(10);
+    resetPeakRss();
+    const auto startRss = currentRss();
+
+    double localSeconds = 0;
+    double remoteSeconds = 0;
+    const CountAllocations allocations(state, AllocationsPer::Iteration);
     for (auto _ : state) {
-        mi_heap_stl_allocator<std::uint64_t> ourAlloc;
-        allocTest(ourAlloc);
+        {
+            Allocs allocs;
+            localSeconds += crossThreadPass<FreeOn::Producer>(allocs, count).count();
+        }
+
+        Allocs allocs;
+        const auto remote = crossThreadPass<FreeOn::Consumer>(allocs, count);
+        remoteSeconds += remote.count();
+        state.SetIterationTime(remote.count());
     }
+
+    const auto messages = static_cast<double>(count * state.iterations());
+    state.counters["msgs_per_sec"] = benchmark::Counter(messages, benchmark::Counter::kIsRate);
+    state.counters["remote_free_ns"] = (remoteSeconds - localSeconds) / messages * 1e9;
+    const auto peak = peakRss();
+    state.counters["peak_rss_mb"] = static_cast<double>(peak) / (1 << 20);
+    state.counters["peak_rss_growth_mb"] = static_cast<double>(peak - std::min(peak, startRss)) / (1 << 20);
 }
 
-// Figure out some workload I think could be affected by using a heap and a non heap allocator?
-static void BM_heapDestroyAlloc(benchmark::State& state) {
-    using UT = std::uint64_t;
+BENCHMARK_TEMPLATE(BM_crossThreadFree, StdAlloc)->UseManualTime();
+BENCHMARK_TEMPLATE(BM_crossThreadFree, MiAlloc)->UseManualTime();
+BENCHMARK_TEMPLATE(BM_crossThreadFree, MiHeapAlloc)->UseManualTime();
+BENCHMARK_TEMPLATE(BM_crossThreadFree, SyncPoolAlloc)->UseManualTime();
+
+// Mixes odd sizes with 8 and 16 byte alignments in an arena with tiny chunks, so
+// that aligning often goes past the end of a chunk. BumpArena used to hand out
+// memory beyond the chunk then, which ASan reports. Without ASan, we still catch
+// misaligned or overlapping allocations.
+static void BM_bumpArena_mixedAlignment(benchmark::State& state) {
+    constexpr std::size_t alignments[] = {1, 8, 16};
+    constexpr std::size_t count = 10'000;
+
     rng.seed(10);
+    std::uniform_int_distribution<std::size_t> sizes(1, 127);
+    std::vector<std::pair<std::byte*, std::size_t>> blocks;
+    blocks.reserve(count);
+
     for (auto _ : state) {
-        mi_heap_destroy_stl_allocator<UT> ourAlloc;
-        allocTest(ourAlloc);
+        BumpArena arena(100);
+        blocks.clear();
+
+        for (std::size_t i = 0; i < count; i++) {
+            const auto alignment = alignments[i % std::size(alignments)];
+            const auto size = i % 2 == 0 ? sizes(rng) | 1 : sizes(rng);
+            auto* p = static_cast<std::byte*>(arena.allocate(size, alignment));
+            if (reinterpret_cast<std::uintptr_t>(p) % alignment != 0) {
+                state.SkipWithError("BumpArena returned misaligned memory");
+                return;
+            }
+
+            std::memset(p, static_cast<int>(i & 0xFF), size);
+            blocks.emplace_back(p, size);
+        }
+
+        for (std::size_t i = 0; i < blocks.size(); i++) {
+            const auto [p, size] = blocks[i];
+            if (std::any_of(p, p + size, [i](const std::byte b) { return b != static_cast<std::byte>(i & 0xFF); })) {
+                state.SkipWithError("BumpArena returned overlapping memory");
+                return;
+            }
+        }
     }
+
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * count));
 }
 
-BENCHMARK(BM_normalAlloc);
-BENCHMARK(BM_heapAlloc);
-BENCHMARK(BM_heapDestroyAlloc);
+BENCHMARK(BM_bumpArena_mixedAlignment);
 
-BENCHMARK_MAIN();
\ No newline at end of file
+BENCHMARK_MAIN();
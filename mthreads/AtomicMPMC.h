@@ -0,0 +1,189 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <optional>
+#include <utility>
+
+#include "WaitPolicy.h"
+
+// A bounded lock-free queue for any number of producers and consumers, after
+// Dmitry Vyukov's bounded MPMC queue: https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+//
+// Every cell has a sequence number, which says whose turn it is. A producer at
+// position pos may write the cell when its sequence is pos, and then sets it to
+// pos+1. A consumer at pos may read it when the sequence is pos+1, and then sets it
+// to pos+Capacity, which is when the producer one lap later may use it. Producers
+// and consumers then only ever fight among themselves, over their own cursor.
+template <typename T, std::size_t Capacity, typename Alloc = std::allocator<T>>
+class AtomicMPMCFifo final {
+public:
+#ifdef __cpp_lib_hardware_interference_size
+    static constexpr std::size_t destructiveInterference = std::hardware_destructive_interference_size;
+#else
+    static constexpr std::size_t destructiveInterference = 64;
+#endif
+
+private:
+    static_assert(Capacity && ((Capacity & (Capacity - 1)) == 0),
+        "As we perform many modulo operations, it's important that a power of 2 is used, "
+        "so that they can be transformed to bitmasks.");
+
+    // Each cell gets its own cache lines, so that producers writing neighbouring
+    // cells don't fight over a line.
+    struct alignas(destructiveInterference) Cell {
+        std::atomic<std::size_t> seq;
+        alignas(T) std::byte storage[sizeof(T)];
+
+        [[nodiscard]] T* value() {
+            return std::launder(reinterpret_cast<T*>(storage));
+        }
+    };
+
+    using cell_allocator = typename std::allocator_traits<Alloc>::template rebind_alloc<Cell>;
+    using cell_traits = std::allocator_traits<cell_allocator>;
+
+    [[no_unique_address]] cell_allocator alloc_;
+    Cell* cells_{nullptr};
+
+    alignas(destructiveInterference) std::atomic<std::size_t> enqueuePos_{0};
+    alignas(destructiveInterference) std::atomic<std::size_t> dequeuePos_{0};
+
+    [[nodiscard]] Cell& cell(const std::size_t pos) {
+        return cells_[pos & (Capacity - 1)];
+    }
+
+    // The distance from the sequence we want, as a signed number.
+    [[nodiscard]] static std::intptr_t lag(const std::size_t seq, const std::size_t want) {
+        return static_cast<std::intptr_t>(seq - want);
+    }
+
+    template <typename... Args>
+    void construct(Cell& c, const std::size_t pos, Args&&... args) {
+        ::new (static_cast<void*>(c.storage)) T(std::forward<Args>(args)...);
+        c.seq.store(pos + 1, std::memory_order::release);
+    }
+
+    [[nodiscard]] T take(Cell& c, const std::size_t pos) {
+        T* ptr = c.value();
+        T val = std::move(*ptr);
+        ptr->~T();
+        c.seq.store(pos + Capacity, std::memory_order::release);
+        return val;
+    }
+
+public:
+    explicit AtomicMPMCFifo(const Alloc& alloc = Alloc{}) : alloc_{alloc} {
+        cells_ = cell_traits::allocate(alloc_, Capacity);
+        for (std::size_t i = 0; i < Capacity; i++)
+            ::new (static_cast<void*>(&cells_[i])) Cell{{i}, {}};
+    }
+
+    ~AtomicMPMCFifo() {
+        for (auto pos = dequeuePos_.load(std::memory_order::acquire); pos != enqueuePos_.load(std::memory_order::acquire); pos++)
+            cell(pos).value()->~T();
+
+        for (std::size_t i = 0; i < Capacity; i++)
+            cells_[i].~Cell();
+        cell_traits::deallocate(alloc_, cells_, Capacity);
+    }
+
+    // Delete the copy constructor, we don't want that.
+    AtomicMPMCFifo(const AtomicMPMCFifo&) = delete;
+    AtomicMPMCFifo& operator=(const AtomicMPMCFifo&) = delete;
+
+    [[nodiscard]] constexpr std::size_t capacity() const {
+        return Capacity;
+    }
+
+    // Only a snapshot, and can be off when producers or consumers are waiting in push or pop.
+    [[nodiscard]] std::size_t size() const {
+        const auto pop = dequeuePos_.load(std::memory_order::acquire);
+        const auto push = enqueuePos_.load(std::memory_order::acquire);
+        return pop < push ? push - pop : 0;
+    }
+
+    [[nodiscard]] bool empty() const {
+        return size() == 0;
+    }
+
+    [[nodiscard]] bool full() const {
+        return size() >= Capacity;
+    }
+
+    template <typename... Args>
+    [[nodiscard]] bool try_emplace(Args&&... args) {
+        auto pos = enqueuePos_.load(std::memory_order::relaxed);
+        while (true) {
+            Cell& c = cell(pos);
+            const auto diff = lag(c.seq.load(std::memory_order::acquire), pos);
+            if (diff == 0) {
+                if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order::relaxed)) {
+                    construct(c, pos, std::forward<Args>(args)...);
+                    return true;
+                }
+            } else if (diff < 0) {
+                // The consumer one lap behind isn't done with the cell, so we are full.
+                return false;
+            } else {
+                pos = enqueuePos_.load(std::memory_order::relaxed);
+            }
+        }
+    }
+
+    [[nodiscard]] bool try_push(const T& value) {
+        return try_emplace(value);
+    }
+
+    [[nodiscard]] bool try_push(T&& value) {
+        return try_emplace(std::move(value));
+    }
+
+    [[nodiscard]] std::optional<T> try_pop() {
+        auto pos = dequeuePos_.load(std::memory_order::relaxed);
+        while (true) {
+            Cell& c = cell(pos);
+            const auto diff = lag(c.seq.load(std::memory_order::acquire), pos + 1);
+            if (diff == 0) {
+                if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order::relaxed))
+                    return take(c, pos);
+            } else if (diff < 0) {
+                return std::nullopt;
+            } else {
+                pos = dequeuePos_.load(std::memory_order::relaxed);
+            }
+        }
+    }
+
+    // The waiting versions take a ticket up front rather than retrying a CAS, and then
+    // wait for their cell to come around, so contention costs one fetch_add each.
+    template <typename... Args>
+    void emplace(Args&&... args) {
+        const auto pos = enqueuePos_.fetch_add(1, std::memory_order::relaxed);
+        Cell& c = cell(pos);
+        while (c.seq.load(std::memory_order::acquire) != pos)
+            detail::cpuRelax();
+
+        construct(c, pos, std::forward<Args>(args)...);
+    }
+
+    void push(const T& value) {
+        emplace(value);
+    }
+
+    void push(T&& value) {
+        emplace(std::move(value));
+    }
+
+    T pop() {
+        const auto pos = dequeuePos_.fetch_add(1, std::memory_order::relaxed);
+        Cell& c = cell(pos);
+        while (c.seq.load(std::memory_order::acquire) != pos + 1)
+            detail::cpuRelax();
+
+        return take(c, pos);
+    }
+};
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <optional>
+#include <utility>
+
+#include "WaitPolicy.h"
+
+// A bounded lock-free queue for any number of producers and a single consumer.
+//
+// The producer side is the same as in AtomicMPMCFifo, with sequence numbered cells
+// that producers claim with a CAS or a ticket. As there is only one consumer, it
+// owns its cursor outright and needs no read-modify-write at all, it just waits
+// for the sequence of the next cell to say that it has been written.
+template <typename T, std::size_t Capacity, typename Alloc = std::allocator<T>>
+class AtomicMPSCFifo final {
+public:
+#ifdef __cpp_lib_hardware_interference_size
+    static constexpr std::size_t destructiveInterference = std::hardware_destructive_interference_size;
+#else
+    static constexpr std::size_t destructiveInterference = 64;
+#endif
+
+private:
+    static_assert(Capacity && ((Capacity & (Capacity - 1)) == 0),
+        "As we perform many modulo operations, it's important that a power of 2 is used, "
+        "so that they can be transformed to bitmasks.");
+
+    struct alignas(destructiveInterference) Cell {
+        std::atomic<std::size_t> seq;
+        alignas(T) std::byte storage[sizeof(T)];
+
+        [[nodiscard]] T* value() {
+            return std::launder(reinterpret_cast<T*>(storage));
+        }
+    };
+
+    using cell_allocator = typename std::allocator_traits<Alloc>::template rebind_alloc<Cell>;
+    using cell_traits = std::allocator_traits<cell_allocator>;
+
+    [[no_unique_address]] cell_allocator alloc_;
+    Cell* cells_{nullptr};
+
+    alignas(destructiveInterference) std::atomic<std::size_t> enqueuePos_{0};
+    // Only written by the consumer, but atomic so that size can be called from anywhere.
+    alignas(destructiveInterference) std::atomic<std::size_t> dequeuePos_{0};
+
+    [[nodiscard]] Cell& cell(const std::size_t pos) {
+        return cells_[pos & (Capacity - 1)];
+    }
+
+    template <typename... Args>
+    void construct(Cell& c, const std::size_t pos, Args&&... args) {
+        ::new (static_cast<void*>(c.storage)) T(std::forward<Args>(args)...);
+        c.seq.store(pos + 1, std::memory_order::release);
+    }
+
+    [[nodiscard]] T take(Cell& c, const std::size_t pos) {
+        T* ptr = c.value();
+        T val = std::move(*ptr);
+        ptr->~T();
+        c.seq.store(pos + Capacity, std::memory_order::release);
+        dequeuePos_.store(pos + 1, std::memory_order::relaxed);
+        return val;
+    }
+
+public:
+    explicit AtomicMPSCFifo(const Alloc& alloc = Alloc{}) : alloc_{alloc} {
+        cells_ = cell_traits::allocate(alloc_, Capacity);
+        for (std::size_t i = 0; i < Capacity; i++)
+            ::new (static_cast<void*>(&cells_[i])) Cell{{i}, {}};
+    }
+
+    ~AtomicMPSCFifo() {
+        for (auto pos = dequeuePos_.load(std::memory_order::acquire); pos != enqueuePos_.load(std::memory_order::acquire); pos++)
+            cell(pos).value()->~T();
+
+        for (std::size_t i = 0; i < Capacity; i++)
+            cells_[i].~Cell();
+        cell_traits::deallocate(alloc_, cells_, Capacity);
+    }
+
+    // Delete the copy constructor, we don't want that.
+    AtomicMPSCFifo(const AtomicMPSCFifo&) = delete;
+    AtomicMPSCFifo& operator=(const AtomicMPSCFifo&) = delete;
+
+    [[nodiscard]] constexpr std::size_t capacity() const {
+        return Capacity;
+    }
+
+    // Only a snapshot, and can be off when producers are waiting in push.
+    [[nodiscard]] std::size_t size() const {
+        const auto pop = dequeuePos_.load(std::memory_order::acquire);
+        const auto push = enqueuePos_.load(std::memory_order::acquire);
+        return pop < push ? push - pop : 0;
+    }
+
+    [[nodiscard]] bool empty() const {
+        return size() == 0;
+    }
+
+    [[nodiscard]] bool full() const {
+        return size() >= Capacity;
+    }
+
+    template <typename... Args>
+    [[nodiscard]] bool try_emplace(Args&&... args) {
+        auto pos = enqueuePos_.load(std::memory_order::relaxed);
+        while (true) {
+            Cell& c = cell(pos);
+            const auto diff = static_cast<std::intptr_t>(c.seq.load(std::memory_order::acquire) - pos);
+            if (diff == 0) {
+                if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order::relaxed)) {
+                    construct(c, pos, std::forward<Args>(args)...);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueuePos_.load(std::memory_order::relaxed);
+            }
+        }
+    }
+
+    [[nodiscard]] bool try_push(const T& value) {
+        return try_emplace(value);
+    }
+
+    [[nodiscard]] bool try_push(T&& value) {
+        return try_emplace(std::move(value));
+    }
+
+    template <typename... Args>
+    void emplace(Args&&... args) {
+        const auto pos = enqueuePos_.fetch_add(1, std::memory_order::relaxed);
+        Cell& c = cell(pos);
+        while (c.seq.load(std::memory_order::acquire) != pos)
+            detail::cpuRelax();
+
+        construct(c, pos, std::forward<Args>(args)...);
+    }
+
+    void push(const T& value) {
+        emplace(value);
+    }
+
+    void push(T&& value) {
+        emplace(std::move(value));
+    }
+
+    [[nodiscard]] std::optional<T> try_pop() {
+        const auto pos = dequeuePos_.load(std::memory_order::relaxed);
+        Cell& c = cell(pos);
+        if (c.seq.load(std::memory_order::acquire) != pos + 1)
+            return std::nullopt;
+
+        return take(c, pos);
+    }
+
+    T pop() {
+        const auto pos = dequeuePos_.load(std::memory_order::relaxed);
+        Cell& c = cell(pos);
+        while (c.seq.load(std::memory_order::acquire) != pos + 1)
+            detail::cpuRelax();
+
+        return take(c, pos);
+    }
+};
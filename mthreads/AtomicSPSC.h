@@ -1,15 +1,39 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <condition_variable>
 #include <mutex>
 #include <memory>
 #include <optional>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+#include "WaitPolicy.h"
 
 #define AT_USE_ALIGNED
 
 
 // Taken from https://www.youtube.com/watch?v=K3P_Lmq6pw0
-template <typename T, std::size_t Capacity, typename Alloc = std::allocator<T>>
+//
+// With Capacity = std::dynamic_extent, the capacity is instead given to the
+// constructor, and rounded up to a power of 2, so that we still get to use a mask
+// rather than a modulo. The mask is then read from memory rather than being a constant.
+//
+// Wait decides how push and pop wait when the ring is full or empty, see WaitPolicy.h.
+//
+// With PublishEvery = K above 1, the fifo publishes lazily: the producer only stores
+// its cursor for every K elements, and the consumer only acks every K elements, so
+// that the line with the cursor moves between the cores once per K elements rather
+// than for every one. Either side also publishes before it waits, or when a try_
+// operation fails, so the two can never wait for each other. The price is latency:
+// an element is not seen until the batch is full, so a producer that stops pushing
+// has to call flush(), and a consumer that stops popping flush_acks(). Until then,
+// size() and empty() only count what has been published.
+template <typename T, std::size_t Capacity, typename Alloc = std::allocator<T>, typename Wait = BusySpinWait,
+          std::size_t PublishEvery = 1>
 class AtomicSPSCFifo final : private Alloc {
 public:
 #ifdef __cpp_lib_hardware_interference_size
@@ -22,25 +46,45 @@ public:
 #endif
 
     static constexpr std::size_t padding = (destructiveInterference - 1) / sizeof(T) + 1;
+    static constexpr bool dynamicCapacity = Capacity == std::dynamic_extent;
+    static constexpr bool lazyPublish = PublishEvery != 1;
 private:
-    static_assert(Capacity && ((Capacity & (Capacity - 1)) == 0),
+    static_assert(dynamicCapacity || (Capacity && ((Capacity & (Capacity - 1)) == 0)),
         "As we perform many modulo operations, it's important that a power of 2 is used, "
         "so that they can be transformed to bitmasks.");
 
     static_assert(8 <= sizeof(std::size_t), "The FIFO relies on std::size_t not wrapping around, "
         "which is not a safe assumption on 32bit hardware.");
 
+    static_assert(PublishEvery != 0, "We can't publish every 0 elements");
+
     using allocator_traits = typename std::allocator_traits<Alloc>::template rebind_traits<T>;
 
 
+    struct NoMask {};
+    struct NoCursor {};
+
+    // In lazy mode, the true positions of the two sides, which run ahead of what
+    // they have published in pushCursor_ and popCursor_.
+    using LocalCursor = std::conditional_t<lazyPublish, std::size_t, NoCursor>;
+
+    // Both sides only ever read these after construction, so they can share a line.
+    [[no_unique_address]] std::conditional_t<dynamicCapacity, std::size_t, NoMask> mask_{};
     T* ring_{nullptr};
 
 #ifdef AT_USE_ALIGNED
     alignas(destructiveInterference) std::atomic<std::size_t> pushCursor_{0};
     alignas(destructiveInterference) std::size_t cachedPopCursor_{0};
+    [[no_unique_address]] LocalCursor localPushCursor_{};
 
     alignas(destructiveInterference) std::atomic<std::size_t> popCursor_{0};
     alignas(destructiveInterference) std::size_t cachedPushCursor_{0};
+    [[no_unique_address]] LocalCursor localPopCursor_{};
+
+    // These are only written when a side parks, so the other side can read them after
+    // every operation without taking the line from anyone.
+    alignas(destructiveInterference) std::atomic<bool> producerParked_{false};
+    alignas(destructiveInterference) std::atomic<bool> consumerParked_{false};
 
 #else
     std::atomic<std::size_t> pushCursor_{0};
@@ -48,47 +92,168 @@ private:
 
     std::size_t cachedPushCursor_{0};
     std::size_t cachedPopCursor_{0};
+
+    [[no_unique_address]] LocalCursor localPushCursor_{};
+    [[no_unique_address]] LocalCursor localPopCursor_{};
+
+    std::atomic<bool> producerParked_{false};
+    std::atomic<bool> consumerParked_{false};
 #endif
 
     static_assert(decltype(pushCursor_)::is_always_lock_free, "We require std::atomic<std::size_t> to be lockfree");
     static_assert(decltype(popCursor_)::is_always_lock_free, "We require std::atomic<std::size_t> to be lockfree");
 
-    [[nodiscard]] static constexpr bool full(const std::size_t popCursor, const std::size_t pushCursor) {
-        return (pushCursor - popCursor) == Capacity;
+    [[nodiscard]] constexpr std::size_t mask() const {
+        if constexpr (dynamicCapacity)
+            return mask_;
+        else
+            return Capacity - 1;
+    }
+
+    [[nodiscard]] constexpr bool full(const std::size_t popCursor, const std::size_t pushCursor) const {
+        return (pushCursor - popCursor) == capacity();
     }
 
     [[nodiscard]] static constexpr bool empty(const std::size_t popCursor, const std::size_t pushCursor) {
         return popCursor == pushCursor;
     }
 
-    [[nodiscard]] constexpr std::size_t& element(const std::size_t cursor) {
-        return ring_[(cursor % Capacity) + padding];
+    // Where the producer is at. We are fighting with noone over this.
+    [[nodiscard]] constexpr std::size_t pushPosition() const {
+        if constexpr (lazyPublish)
+            return localPushCursor_;
+        else
+            return pushCursor_.load(std::memory_order::relaxed);
+    }
+
+    [[nodiscard]] constexpr std::size_t popPosition() const {
+        if constexpr (lazyPublish)
+            return localPopCursor_;
+        else
+            return popCursor_.load(std::memory_order::relaxed);
+    }
+
+    [[nodiscard]] constexpr T& element(const std::size_t cursor) {
+        return ring_[(cursor & mask()) + padding];
+    }
+
+    // Waits for the consumer to make room, if the ring looks full. As the ring is full
+    // exactly when cachedPopCursor_ is current, any new value means there is room.
+    constexpr void waitForRoom(const std::size_t curPush) {
+        if (full(cachedPopCursor_, curPush)) {
+            flush();
+            cachedPopCursor_ = Wait::wait(popCursor_, cachedPopCursor_, producerParked_);
+        }
+    }
+
+    // Waits for the producer to push something, if the ring looks empty.
+    constexpr void waitForElements(const std::size_t curPop) {
+        if (empty(curPop, cachedPushCursor_)) {
+            flush_acks();
+            cachedPushCursor_ = Wait::wait(pushCursor_, cachedPushCursor_, consumerParked_);
+        }
+    }
+
+    // Moves the producer to cursor, and publishes it unless we are lazy and the batch
+    // isn't full yet.
+    constexpr void advancePush(const std::size_t cursor) {
+        if constexpr (lazyPublish) {
+            localPushCursor_ = cursor;
+            if (cursor - pushCursor_.load(std::memory_order::relaxed) < PublishEvery)
+                return;
+        }
+        publishPush(cursor);
+    }
+
+    constexpr void advancePop(const std::size_t cursor) {
+        if constexpr (lazyPublish) {
+            localPopCursor_ = cursor;
+            if (cursor - popCursor_.load(std::memory_order::relaxed) < PublishEvery)
+                return;
+        }
+        publishPop(cursor);
+    }
+
+    // Publishes the push cursor, and wakes the consumer if it is asleep. The fence
+    // pairs with the one in Wait::wait, and is only paid for with a parking policy.
+    constexpr void publishPush(const std::size_t cursor) {
+        pushCursor_.store(cursor, std::memory_order::release);
+        if constexpr (Wait::parks) {
+            std::atomic_thread_fence(std::memory_order::seq_cst);
+            if (consumerParked_.load(std::memory_order::relaxed))
+                pushCursor_.notify_one();
+        }
+    }
+
+    constexpr void publishPop(const std::size_t cursor) {
+        popCursor_.store(cursor, std::memory_order::release);
+        if constexpr (Wait::parks) {
+            std::atomic_thread_fence(std::memory_order::seq_cst);
+            if (producerParked_.load(std::memory_order::relaxed))
+                popCursor_.notify_one();
+        }
+    }
+
+    // Constructs values into the n slots from cursor and on. The slots are split in
+    // at most two contiguous runs, one up to the end of the ring and one from the start.
+    constexpr void constructRun(const std::size_t cursor, const T* values, const std::size_t n) {
+        const auto first = std::min(n, capacity() - (cursor & mask()));
+        T* head = &element(cursor);
+        for (std::size_t i = 0; i < first; i++)
+            allocator_traits::construct(*this, head + i, values[i]);
+
+        T* tail = &element(cursor + first);
+        for (std::size_t i = first; i < n; i++)
+            allocator_traits::construct(*this, tail + (i - first), values[i]);
+    }
+
+    // Moves the n elements from cursor and on into out, destroying them in the ring.
+    constexpr void moveRun(const std::size_t cursor, T* out, const std::size_t n) {
+        const auto first = std::min(n, capacity() - (cursor & mask()));
+        T* head = &element(cursor);
+        for (std::size_t i = 0; i < first; i++) {
+            out[i] = std::move(head[i]);
+            allocator_traits::destroy(*this, head + i);
+        }
+
+        T* tail = &element(cursor + first);
+        for (std::size_t i = first; i < n; i++) {
+            out[i] = std::move(tail[i - first]);
+            allocator_traits::destroy(*this, tail + (i - first));
+        }
     }
 
 public:
-    constexpr explicit AtomicSPSCFifo(const Alloc& alloc = Alloc{})
+    constexpr explicit AtomicSPSCFifo(const Alloc& alloc = Alloc{}) requires (!dynamicCapacity)
         : Alloc{alloc}, ring_{allocator_traits::allocate(*this, Capacity + 2*padding)} {
-        static_assert(alignof(AtomicSPSCFifo<T, Capacity, Alloc>) == destructiveInterference);
-        static_assert(sizeof(AtomicSPSCFifo<T, Capacity, Alloc>) >= 3 * destructiveInterference);
+        static_assert(alignof(AtomicSPSCFifo) == destructiveInterference);
+        static_assert(sizeof(AtomicSPSCFifo) >= 3 * destructiveInterference);
+    }
+
+    constexpr explicit AtomicSPSCFifo(const std::size_t minCapacity, const Alloc& alloc = Alloc{}) requires dynamicCapacity
+        : Alloc{alloc}, mask_{std::bit_ceil(std::max<std::size_t>(minCapacity, 1)) - 1},
+          ring_{allocator_traits::allocate(*this, mask_ + 1 + 2*padding)} {
+        static_assert(alignof(AtomicSPSCFifo) == destructiveInterference);
+        static_assert(sizeof(AtomicSPSCFifo) >= 3 * destructiveInterference);
     }
 
     ~AtomicSPSCFifo() {
-        cachedPopCursor_ = popCursor_.load(std::memory_order::acquire);
-        cachedPushCursor_ = pushCursor_.load(std::memory_order::acquire);
+        cachedPopCursor_ = lazyPublish ? popPosition() : popCursor_.load(std::memory_order::acquire);
+        cachedPushCursor_ = lazyPublish ? pushPosition() : pushCursor_.load(std::memory_order::acquire);
         while (!empty(cachedPopCursor_, cachedPushCursor_)) {
             allocator_traits::destroy(*this, &element(cachedPopCursor_));
             cachedPopCursor_++;
         }
 
-        allocator_traits::deallocate(*this, ring_, Capacity + 2*padding);
+        allocator_traits::deallocate(*this, ring_, capacity() + 2*padding);
     }
 
     // Delete the copy constructor, we don't want that.
     AtomicSPSCFifo(const AtomicSPSCFifo&) = delete;
     AtomicSPSCFifo& operator=(const AtomicSPSCFifo&) = delete;
 
-    [[nodiscard]] constexpr auto capacity() const {
-        return Capacity;
+    [[nodiscard]] constexpr std::size_t capacity() const {
+        return mask() + 1;
     }
 
     [[nodiscard]] constexpr auto size() const {
@@ -101,10 +266,28 @@ public:
     }
 
     [[nodiscard]] constexpr bool full() const {
-        return size() == Capacity;
+        return size() == capacity();
+    }
+
+    // Producer only. Publishes everything pushed so far, in lazy mode. Does nothing
+    // otherwise, as everything is published right away.
+    constexpr void flush() {
+        if constexpr (lazyPublish) {
+            if (localPushCursor_ != pushCursor_.load(std::memory_order::relaxed))
+                publishPush(localPushCursor_);
+        }
     }
 
-    constexpr void push_futex(const T& value) {
+    // Consumer only. Acks everything popped so far, in lazy mode.
+    constexpr void flush_acks() {
+        if constexpr (lazyPublish) {
+            if (localPopCursor_ != popCursor_.load(std::memory_order::relaxed))
+                publishPop(localPopCursor_);
+        }
+    }
+
+    // The futex pair below always publishes right away, so it doesn't mix with lazy mode.
+    constexpr void push_futex(const T& value) requires (!lazyPublish) {
         // we are fighting with noone over this
         const auto curPush = pushCursor_.load(std::memory_order::relaxed);
         if (full(cachedPopCursor_, curPush)) {
@@ -118,7 +301,7 @@ public:
         pushCursor_.notify_one();
     }
 
-    constexpr T pop_futex() {
+    constexpr T pop_futex() requires (!lazyPublish) {
         const auto curPop = popCursor_.load(std::memory_order::relaxed);
         if (empty(curPop, cachedPushCursor_)) {
             pushCursor_.wait(cachedPushCursor_, std::memory_order::acquire);
@@ -134,62 +317,209 @@ public:
         return val;
     }
 
-    constexpr void push(const T& value) {
+    // Constructs the element in place from args, waiting for room when full.
+    template <typename... Args>
+    constexpr void emplace(Args&&... args) {
         // we are fighting with noone over this
-        const auto curPush = pushCursor_.load(std::memory_order::relaxed);
-        while (full(cachedPopCursor_, curPush))
-            cachedPopCursor_ = popCursor_.load(std::memory_order::acquire);
+        const auto curPush = pushPosition();
+        waitForRoom(curPush);
 
-        allocator_traits::construct(*this, &element(curPush), value);
+        allocator_traits::construct(*this, &element(curPush), std::forward<Args>(args)...);
 
-        pushCursor_.store(curPush + 1, std::memory_order::release);
+        advancePush(curPush + 1);
+    }
+
+    constexpr void push(const T& value) {
+        emplace(value);
+    }
+
+    constexpr void push(T&& value) {
+        emplace(std::move(value));
     }
 
     constexpr T pop() {
-        const auto curPop = popCursor_.load(std::memory_order::relaxed);
+        const auto curPop = popPosition();
 
 
-        while (empty(curPop, cachedPushCursor_))
-            cachedPushCursor_ = pushCursor_.load(std::memory_order::acquire);
+        waitForElements(curPop);
 
         auto val = std::move(element(curPop));
         allocator_traits::destroy(*this, &element(curPop));
 
-        popCursor_.store(curPop + 1, std::memory_order::release);
+        advancePop(curPop + 1);
         return val;
     }
 
     
-    [[nodiscard]] constexpr bool try_push(const T& value) {
+    // Same as emplace, but returns false rather than waiting when full. The args are
+    // then left untouched.
+    template <typename... Args>
+    [[nodiscard]] constexpr bool try_emplace(Args&&... args) {
         // This is not what we need to optimize for.
-        const auto curPush = pushCursor_.load(std::memory_order::relaxed);
+        const auto curPush = pushPosition();
         if (full(cachedPopCursor_, curPush)) {
             cachedPopCursor_ = popCursor_.load(std::memory_order::acquire);
-            if (full(cachedPopCursor_, curPush))
+            if (full(cachedPopCursor_, curPush)) {
+                flush();
                 return false;
+            }
         }
 
-        allocator_traits::construct(*this, &element(curPush), value);
+        allocator_traits::construct(*this, &element(curPush), std::forward<Args>(args)...);
 
-        pushCursor_.store(curPush+1, std::memory_order::release);
+        advancePush(curPush+1);
         return true;
     }
 
+    [[nodiscard]] constexpr bool try_push(const T& value) {
+        return try_emplace(value);
+    }
+
+    [[nodiscard]] constexpr bool try_push(T&& value) {
+        return try_emplace(std::move(value));
+    }
+
     [[nodiscard]] constexpr std::optional<T> try_pop() {
-        const auto curPop = popCursor_.load(std::memory_order::relaxed);
+        const auto curPop = popPosition();
         if (empty(curPop, cachedPushCursor_)) {
             cachedPushCursor_ = pushCursor_.load(std::memory_order::acquire);
-            if (empty(curPop, cachedPushCursor_))
+            if (empty(curPop, cachedPushCursor_)) {
+                flush_acks();
                 return std::nullopt;
+            }
         }
 
         // TODO(rHermes): Try to make sure this is actually using the move constructor later.
         auto val = std::move(element(curPop));
         allocator_traits::destroy(*this, &element(curPop));
 
-        popCursor_.store(curPop+1, std::memory_order::release);
+        advancePop(curPop+1);
         return val;
     }
 
+    // Pushes all of values, waiting for room when full. Rather than publishing every
+    // element, we fill all the free slots we can see and publish them in one store.
+    constexpr void push_n(std::span<const T> values) {
+        auto curPush = pushPosition();
+        while (!values.empty()) {
+            waitForRoom(curPush);
+
+            const auto n = std::min(values.size(), capacity() - (curPush - cachedPopCursor_));
+            constructRun(curPush, values.data(), n);
+
+            curPush += n;
+            advancePush(curPush);
+            values = values.subspan(n);
+        }
+    }
+
+    // Pops exactly out.size() elements, waiting for them as needed, and acking
+    // everything that was available at once.
+    constexpr void pop_n(std::span<T> out) {
+        auto curPop = popPosition();
+        while (!out.empty()) {
+            waitForElements(curPop);
+
+            const auto n = std::min(out.size(), cachedPushCursor_ - curPop);
+            moveRun(curPop, out.data(), n);
+
+            curPop += n;
+            advancePop(curPop);
+            out = out.subspan(n);
+        }
+    }
+
+    // Pushes as many of values as there is room for, and returns how many that was.
+    [[nodiscard]] constexpr std::size_t try_push_bulk(std::span<const T> values) {
+        const auto curPush = pushPosition();
+        if (capacity() - (curPush - cachedPopCursor_) < values.size())
+            cachedPopCursor_ = popCursor_.load(std::memory_order::acquire);
+
+        const auto n = std::min(values.size(), capacity() - (curPush - cachedPopCursor_));
+        if (n == 0) {
+            flush();
+            return 0;
+        }
+
+        constructRun(curPush, values.data(), n);
+        advancePush(curPush + n);
+        return n;
+    }
+
+    // Pops up to out.size() elements into out, and returns how many that was.
+    [[nodiscard]] constexpr std::size_t try_pop_bulk(std::span<T> out) {
+        const auto curPop = popPosition();
+        if (cachedPushCursor_ - curPop < out.size())
+            cachedPushCursor_ = pushCursor_.load(std::memory_order::acquire);
+
+        const auto n = std::min(out.size(), cachedPushCursor_ - curPop);
+        if (n == 0) {
+            flush_acks();
+            return 0;
+        }
+
+        moveRun(curPop, out.data(), n);
+        advancePop(curPop + n);
+        return n;
+    }
+
+    // The zero-copy producer side. reserve() waits for and returns the next free slot,
+    // as raw memory to construct the element in, for example with std::construct_at.
+    // commit() then publishes it. Only a single slot can be reserved at a time.
+    [[nodiscard]] constexpr T* reserve() {
+        const auto curPush = pushPosition();
+        waitForRoom(curPush);
+
+        return &element(curPush);
+    }
+
+    // Same as reserve, but returns nullptr rather than waiting when full.
+    [[nodiscard]] constexpr T* try_reserve() {
+        const auto curPush = pushPosition();
+        if (full(cachedPopCursor_, curPush)) {
+            cachedPopCursor_ = popCursor_.load(std::memory_order::acquire);
+            if (full(cachedPopCursor_, curPush)) {
+                flush();
+                return nullptr;
+            }
+        }
+
+        return &element(curPush);
+    }
+
+    // Publishes the element constructed in the slot given by reserve.
+    constexpr void commit() {
+        const auto curPush = pushPosition();
+        advancePush(curPush + 1);
+    }
+
+    // The zero-copy consumer side. front() waits for and returns the oldest element,
+    // which stays in the ring until release() destroys it.
+    [[nodiscard]] constexpr T* front() {
+        const auto curPop = popPosition();
+        waitForElements(curPop);
+
+        return &element(curPop);
+    }
+
+    // Same as front, but returns nullptr rather than waiting when empty.
+    [[nodiscard]] constexpr T* try_front() {
+        const auto curPop = popPosition();
+        if (empty(curPop, cachedPushCursor_)) {
+            cachedPushCursor_ = pushCursor_.load(std::memory_order::acquire);
+            if (empty(curPop, cachedPushCursor_)) {
+                flush_acks();
+                return nullptr;
+            }
+        }
 
-};
\ No newline at end of file
+        return &element(curPop);
+    }
+
+    // Destroys the element given by front, and frees its slot.
+    constexpr void release() {
+        const auto curPop = popPosition();
+        allocator_traits::destroy(*this, &element(curPop));
+        advancePop(curPop + 1);
+    }
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+// The work-stealing deque of Chase and Lev, with the memory orders from Lê et al.,
+// "Correct and Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013).
+//
+// The owner pushes and pops at the bottom, like a stack, so it keeps working on
+// what is hot in its cache. Thieves steal from the top, where the oldest and, in
+// divide and conquer, biggest pieces of work are. The only time the owner has to
+// synchronize with the thieves is over the very last element.
+//
+// The array grows when full. The old arrays may still be read by a thief in the
+// middle of a steal, so they are only freed with the deque.
+template <typename T>
+class ChaseLevDeque {
+    static_assert(std::is_trivially_copyable_v<T>, "The elements are copied racily, so they must be trivially copyable");
+
+#ifdef __cpp_lib_hardware_interference_size
+    static constexpr std::size_t destructiveInterference = std::hardware_destructive_interference_size;
+#else
+    static constexpr std::size_t destructiveInterference = 64;
+#endif
+
+    struct Array {
+        const std::int64_t capacity;
+        std::unique_ptr<std::atomic<T>[]> slots = std::make_unique<std::atomic<T>[]>(static_cast<std::size_t>(capacity));
+
+        explicit Array(std::int64_t cap) : capacity{cap} {}
+
+        [[nodiscard]] T get(const std::int64_t i) const {
+            return slots[static_cast<std::size_t>(i & (capacity - 1))].load(std::memory_order::relaxed);
+        }
+
+        void put(const std::int64_t i, const T value) {
+            slots[static_cast<std::size_t>(i & (capacity - 1))].store(value, std::memory_order::relaxed);
+        }
+    };
+
+    alignas(destructiveInterference) std::atomic<std::int64_t> top_{0};
+    alignas(destructiveInterference) std::atomic<std::int64_t> bottom_{0};
+    std::atomic<Array*> array_;
+    // Owned by the owner, the current array is always the last one.
+    std::vector<std::unique_ptr<Array>> arrays_;
+
+    Array* grow(Array* old, const std::int64_t bottom, const std::int64_t top) {
+        auto next = std::make_unique<Array>(2 * old->capacity);
+        for (auto i = top; i < bottom; i++)
+            next->put(i, old->get(i));
+
+        Array* raw = next.get();
+        arrays_.push_back(std::move(next));
+        array_.store(raw, std::memory_order::release);
+        return raw;
+    }
+
+public:
+    explicit ChaseLevDeque(const std::size_t capacity = 1024) {
+        std::size_t cap = 1;
+        while (cap < capacity)
+            cap *= 2;
+
+        arrays_.push_back(std::make_unique<Array>(static_cast<std::int64_t>(cap)));
+        array_.store(arrays_.back().get(), std::memory_order::relaxed);
+    }
+
+    ChaseLevDeque(const ChaseLevDeque&) = delete;
+    ChaseLevDeque& operator=(const ChaseLevDeque&) = delete;
+
+    // Only a snapshot, but good enough to see if there is anything to steal.
+    [[nodiscard]] bool empty() const {
+        return bottom_.load(std::memory_order::relaxed) <= top_.load(std::memory_order::relaxed);
+    }
+
+    // Owner only.
+    void push(const T value) {
+        const auto b = bottom_.load(std::memory_order::relaxed);
+        const auto t = top_.load(std::memory_order::acquire);
+        Array* a = array_.load(std::memory_order::relaxed);
+        if (a->capacity - 1 < b - t)
+            a = grow(a, b, t);
+
+        a->put(b, value);
+        std::atomic_thread_fence(std::memory_order::release);
+        bottom_.store(b + 1, std::memory_order::relaxed);
+    }
+
+    // Owner only. Takes the newest element.
+    [[nodiscard]] std::optional<T> pop() {
+        const auto b = bottom_.load(std::memory_order::relaxed) - 1;
+        Array* a = array_.load(std::memory_order::relaxed);
+        bottom_.store(b, std::memory_order::relaxed);
+        std::atomic_thread_fence(std::memory_order::seq_cst);
+        auto t = top_.load(std::memory_order::relaxed);
+
+        if (b < t) {
+            // It was already empty.
+            bottom_.store(b + 1, std::memory_order::relaxed);
+            return std::nullopt;
+        }
+
+        std::optional<T> value = a->get(b);
+        if (t == b) {
+            // The last element, which a thief may be after as well.
+            if (!top_.compare_exchange_strong(t, t + 1, std::memory_order::seq_cst, std::memory_order::relaxed))
+                value = std::nullopt;
+            bottom_.store(b + 1, std::memory_order::relaxed);
+        }
+
+        return value;
+    }
+
+    // Any thread. Takes the oldest element, and gives up rather than retrying when
+    // it loses a race, as the caller will want to look elsewhere anyway.
+    [[nodiscard]] std::optional<T> steal() {
+        auto t = top_.load(std::memory_order::acquire);
+        std::atomic_thread_fence(std::memory_order::seq_cst);
+        const auto b = bottom_.load(std::memory_order::acquire);
+        if (b <= t)
+            return std::nullopt;
+
+        Array* a = array_.load(std::memory_order::acquire);
+        const T value = a->get(t);
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order::seq_cst, std::memory_order::relaxed))
+            return std::nullopt;
+
+        return value;
+    }
+};
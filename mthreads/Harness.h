@@ -0,0 +1,237 @@
+#pragma once
+
+// The plumbing shared by the queue benchmarks: pinning threads, starting a sender
+// and a receiver together, giving every queue the same interface, the messages we
+// send and the statistics we report.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <iomanip>
+#include <iostream>
+#include <latch>
+#include <locale>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+
+#include "Topology.h"
+
+#include "../third_party/SPSCQueue.h"
+
+struct separate_thousands : std::numpunct<char> {
+    char_type do_thousands_sep() const override { return ','; }  // separate with commas
+    string_type do_grouping() const override { return "\3"; } // groups of 3 digit
+};
+
+// Pins t to cpu. We only complain if it fails, so that the benchmarks still run
+// on machines with fewer CPUs than asked for.
+inline void pinThread(const pthread_t t, const int cpu) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    const int rc = pthread_setaffinity_np(t, sizeof(cpu_set_t), &cpuset);
+    if (rc != 0) {
+        std::cerr << "Error calling pthread_setaffinity_np: " << rc << "\n";
+    }
+}
+
+inline void pinThread(std::thread& t, const int cpu) {
+    pinThread(t.native_handle(), cpu);
+}
+
+// Runs send and recv on their own threads, pinned to the CPUs of pair, and lets
+// them go at the same time. Returns the time from then until both are done.
+template <typename Send, typename Recv>
+std::chrono::duration<double> runPinnedPair(const CpuPair& pair, Send send, Recv recv) {
+    std::latch all{3};
+
+    std::thread sender([&all, &send]() {
+        all.arrive_and_wait();
+        send();
+    });
+    pinThread(sender, pair.sendCpu);
+
+    std::thread receiver([&all, &recv]() {
+        all.arrive_and_wait();
+        recv();
+    });
+    pinThread(receiver, pair.recvCpu);
+
+    const auto beginTS = std::chrono::steady_clock::now();
+    all.arrive_and_wait();
+    sender.join();
+    receiver.join();
+    const auto endTS = std::chrono::steady_clock::now();
+
+    return endTS - beginTS;
+}
+
+// Prints how fast we sent N things in diff, in the format all the benchmarks use,
+// and returns the rate.
+inline std::size_t reportRate(const std::string& what, const std::size_t N, const std::chrono::duration<double> diff) {
+    const auto perSecond = static_cast<std::size_t>(static_cast<double>(N) / diff.count());
+
+    auto thousands = std::make_unique<separate_thousands>();
+    const auto prev = std::cout.imbue(std::locale(std::cout.getloc(), thousands.release()));
+    std::cout << "We sent " << N << " " << what << " in " << std::setprecision(3) << diff << " making it: " << perSecond << " per second" << std::endl;
+    std::cout.imbue(prev);
+
+    return perSecond;
+}
+
+// A message big enough that copying it in and out of the queue is a real cost.
+template <std::size_t Size>
+struct Payload {
+    static_assert(sizeof(std::size_t) < Size, "The payload must have room for the sequence number");
+
+    std::size_t seq;
+    std::array<std::byte, Size - sizeof(std::size_t)> data;
+};
+
+// What we send for a given size: the bare sequence number when that is all there is room for.
+template <std::size_t Size>
+using Message = std::conditional_t<Size == sizeof(std::size_t), std::size_t, Payload<Size>>;
+
+template <typename M>
+[[nodiscard]] M makeMessage(const std::size_t seq) {
+    if constexpr (std::is_same_v<M, std::size_t>) {
+        return seq;
+    } else {
+        M m;
+        m.seq = seq;
+        m.data.fill(static_cast<std::byte>(seq));
+        return m;
+    }
+}
+
+// Checks that m is the message makeMessage(seq) made.
+template <typename M>
+[[nodiscard]] bool checkMessage(const M& m, const std::size_t seq) {
+    if constexpr (std::is_same_v<M, std::size_t>) {
+        return m == seq;
+    } else {
+        return m.seq == seq && m.data.back() == static_cast<std::byte>(seq);
+    }
+}
+
+// Gives all the queues the same push, pop, try_push and try_pop, so that each
+// benchmark only has to be written once. flush and flushAcks publish what a queue
+// that publishes lazily holds back, and do nothing for the others. A sender has to
+// flush when it is done, and a receiver flushAcks, before the queue is empty.
+template <typename Q>
+struct QueueOps {
+    template <typename V>
+    static void push(Q& q, V&& value) {
+        q.push(std::forward<V>(value));
+    }
+
+    static auto pop(Q& q) {
+        return q.pop();
+    }
+
+    template <typename V>
+    [[nodiscard]] static bool tryPush(Q& q, V&& value) {
+        return q.try_push(std::forward<V>(value));
+    }
+
+    static auto tryPop(Q& q) {
+        return q.try_pop();
+    }
+
+    static void flush(Q& q) {
+        if constexpr (requires { q.flush(); })
+            q.flush();
+    }
+
+    static void flushAcks(Q& q) {
+        if constexpr (requires { q.flush_acks(); })
+            q.flush_acks();
+    }
+};
+
+// rigtorp's queue has no popping by value, you read the front and then pop it.
+template <typename T, typename Alloc>
+struct QueueOps<rigtorp::SPSCQueue<T, Alloc>> {
+    using Q = rigtorp::SPSCQueue<T, Alloc>;
+
+    template <typename V>
+    static void push(Q& q, V&& value) {
+        q.push(std::forward<V>(value));
+    }
+
+    static T pop(Q& q) {
+        T* res = q.front();
+        while (res == nullptr)
+            res = q.front();
+
+        T val = std::move(*res);
+        q.pop();
+        return val;
+    }
+
+    template <typename V>
+    [[nodiscard]] static bool tryPush(Q& q, V&& value) {
+        return q.try_push(std::forward<V>(value));
+    }
+
+    static std::optional<T> tryPop(Q& q) {
+        T* res = q.front();
+        if (res == nullptr)
+            return std::nullopt;
+
+        std::optional<T> val{std::move(*res)};
+        q.pop();
+        return val;
+    }
+
+    static void flush(Q&) {}
+
+    static void flushAcks(Q&) {}
+};
+
+// The summary of a set of repeated measurements.
+struct RunStats {
+    double median;
+    double p99;
+    double mean;
+    double stddev;
+    double min;
+    double max;
+};
+
+// Percentiles are nearest rank, so with few samples p99 is simply the worst run.
+[[nodiscard]] inline RunStats summarize(std::vector<double> xs) {
+    if (xs.empty())
+        return {};
+
+    std::sort(xs.begin(), xs.end());
+    const auto n = xs.size();
+    const auto rank = [&xs, n](const double p) {
+        const auto idx = static_cast<std::size_t>(std::ceil(p * static_cast<double>(n)));
+        return xs[std::clamp<std::size_t>(idx, 1, n) - 1];
+    };
+
+    const double mean = std::accumulate(xs.begin(), xs.end(), 0.0) / static_cast<double>(n);
+    double var = 0;
+    for (const auto x : xs)
+        var += (x - mean) * (x - mean);
+
+    const double median = n % 2 == 1 ? xs[n / 2] : (xs[n / 2 - 1] + xs[n / 2]) / 2;
+    return {median, rank(0.99), mean, std::sqrt(var / static_cast<double>(n)), xs.front(), xs.back()};
+}
+
+inline void writeJson(std::ostream& out, const RunStats& s) {
+    out << "{\"median\": " << s.median << ", \"p99\": " << s.p99 << ", \"mean\": " << s.mean
+        << ", \"stddev\": " << s.stddev << ", \"min\": " << s.min << ", \"max\": " << s.max << "}";
+}
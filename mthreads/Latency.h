@@ -0,0 +1,166 @@
+#pragma once
+
+// Measuring the latency of single messages: clocks cheap enough to read for every
+// message, and a histogram cheap enough to record every message in.
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <thread>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// The clocks give a raw now() in ticks, and turn a difference of ticks into ns.
+
+struct SteadyClock {
+    static constexpr const char* name = "steady";
+
+    [[nodiscard]] static std::uint64_t now() {
+        return static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+    }
+
+    [[nodiscard]] std::uint64_t toNs(const std::uint64_t ticks) const {
+        return ticks;
+    }
+};
+
+static_assert(std::is_same_v<std::chrono::steady_clock::duration, std::chrono::nanoseconds>,
+    "SteadyClock takes the ticks of steady_clock to be ns");
+
+// The time stamp counter, read with rdtscp so that it isn't taken before the work
+// in front of it is done. It is a fraction of the cost of steady_clock, but only
+// comparable between cores on CPUs with an invariant TSC, which is anything recent.
+// The tick rate is measured against steady_clock when constructed. On other
+// architectures, this is just steady_clock.
+class TscClock {
+    double nsPerTick_{1.0};
+
+public:
+    static constexpr const char* name = "tsc";
+
+    TscClock() {
+#if defined(__x86_64__) || defined(__i386__)
+        const auto beginTS = std::chrono::steady_clock::now();
+        const auto begin = now();
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        const auto end = now();
+        const std::chrono::duration<double, std::nano> diff = std::chrono::steady_clock::now() - beginTS;
+        nsPerTick_ = diff.count() / static_cast<double>(end - begin);
+#endif
+    }
+
+    [[nodiscard]] static std::uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned int aux;
+        return __rdtscp(&aux);
+#else
+        return SteadyClock::now();
+#endif
+    }
+
+    [[nodiscard]] std::uint64_t toNs(const std::uint64_t ticks) const {
+        return static_cast<std::uint64_t>(static_cast<double>(ticks) * nsPerTick_);
+    }
+};
+
+// A log-linear histogram in the style of HdrHistogram. Every power of two is split
+// in 2^SubBits equal buckets, so a value is off by at most 1 in 2^SubBits, about
+// 0.8% by default, from 0 all the way up to 2^64, in a fixed 60 kB of counters.
+// Recording is a couple of shifts and an increment, so the consumer can record
+// every message without slowing down noticeably.
+template <unsigned SubBits = 7>
+class LogLinearHistogram {
+    static constexpr std::uint64_t subBuckets = std::uint64_t{1} << SubBits;
+    static constexpr std::size_t bucketCount = (64 - SubBits + 1) * subBuckets;
+
+    // On the heap, as it's too big for the stack of a benchmark thread to carry around.
+    std::unique_ptr<std::array<std::uint64_t, bucketCount>> counts_ = std::make_unique<std::array<std::uint64_t, bucketCount>>();
+    std::uint64_t total_{0};
+    std::uint64_t sum_{0};
+    std::uint64_t max_{0};
+
+    // The values below 2 * subBuckets are their own bucket. Above that, a value is
+    // shifted down until it has SubBits + 1 bits, and the shift picks the row.
+    [[nodiscard]] static std::size_t index(const std::uint64_t value) {
+        if (value < 2 * subBuckets)
+            return static_cast<std::size_t>(value);
+
+        const auto shift = static_cast<unsigned>(std::bit_width(value)) - SubBits - 1;
+        return static_cast<std::size_t>(shift * subBuckets + (value >> shift));
+    }
+
+    // The highest value that goes in bucket idx.
+    [[nodiscard]] static std::uint64_t highest(const std::size_t idx) {
+        if (idx < 2 * subBuckets)
+            return idx;
+
+        const auto shift = idx / subBuckets - 1;
+        const auto mantissa = idx - shift * subBuckets;
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+public:
+    void record(const std::uint64_t value) {
+        (*counts_)[index(value)]++;
+        total_++;
+        sum_ += value;
+        max_ = std::max(max_, value);
+    }
+
+    void merge(const LogLinearHistogram& other) {
+        for (std::size_t i = 0; i < bucketCount; i++)
+            (*counts_)[i] += (*other.counts_)[i];
+        total_ += other.total_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    void clear() {
+        counts_->fill(0);
+        total_ = sum_ = max_ = 0;
+    }
+
+    [[nodiscard]] std::uint64_t count() const {
+        return total_;
+    }
+
+    [[nodiscard]] std::uint64_t max() const {
+        return max_;
+    }
+
+    [[nodiscard]] double mean() const {
+        return total_ == 0 ? 0.0 : static_cast<double>(sum_) / static_cast<double>(total_);
+    }
+
+    // The value at percentile p, in [0, 100]. Like HdrHistogram, this is the highest
+    // value that falls in the same bucket, so it errs on the high side.
+    [[nodiscard]] std::uint64_t percentile(const double p) const {
+        if (total_ == 0)
+            return 0;
+
+        const auto rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::ceil(p / 100.0 * static_cast<double>(total_))));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < bucketCount; i++) {
+            seen += (*counts_)[i];
+            if (rank <= seen)
+                return std::min(highest(i), max_);
+        }
+        return max_;
+    }
+
+    void writeJson(std::ostream& out) const {
+        out << "{\"p50\": " << percentile(50) << ", \"p99\": " << percentile(99) << ", \"p99.9\": " << percentile(99.9)
+            << ", \"max\": " << max() << ", \"mean\": " << mean() << ", \"count\": " << count() << "}";
+    }
+};
+
+using LatencyHistogram = LogLinearHistogram<>;
@@ -1,14 +1,22 @@
 #pragma once
 
+#include <algorithm>
 #include <cinttypes>
 #include <condition_variable>
 #include <mutex>
 #include <memory>
 #include <optional>
+#include <span>
+#include <type_traits>
 
 // Taken from https://www.youtube.com/watch?v=K3P_Lmq6pw0
+//
+// With Capacity = std::dynamic_extent, the capacity is given to the constructor instead.
 template <typename T, std::size_t Capacity, typename Alloc = std::allocator<T>>
 class MutexSPSCFifo final : private Alloc {
+public:
+    static constexpr bool dynamicCapacity = Capacity == std::dynamic_extent;
+
 private:
     using allocator_traits = typename std::allocator_traits<Alloc>::template rebind_traits<T>;
     // using allocator_traits = typename std::allocator_traits<Alloc>;
@@ -16,6 +24,10 @@ private:
     mutable std::mutex mtx_;
     mutable std::condition_variable cv_;
 
+    struct NoCapacity {};
+
+    // Only stored with a dynamic capacity, so that a fixed one stays a constant.
+    [[no_unique_address]] std::conditional_t<dynamicCapacity, std::size_t, NoCapacity> capacity_{};
     T* ring_{nullptr};
 
     std::size_t pushCursor_{0};
@@ -32,28 +44,34 @@ private:
     }
 
     [[nodiscard]] constexpr bool noLockFull() const {
-        return noLockSize() == Capacity;
+        return noLockSize() == capacity();
     }
 
 
 public:
-    constexpr explicit MutexSPSCFifo(const Alloc& alloc = Alloc{})
+    constexpr explicit MutexSPSCFifo(const Alloc& alloc = Alloc{}) requires (!dynamicCapacity)
         : Alloc{alloc}, ring_{allocator_traits::allocate(*this, Capacity)} {}
 
+    constexpr explicit MutexSPSCFifo(const std::size_t minCapacity, const Alloc& alloc = Alloc{}) requires dynamicCapacity
+        : Alloc{alloc}, capacity_{std::max<std::size_t>(minCapacity, 1)}, ring_{allocator_traits::allocate(*this, capacity_)} {}
+
     ~MutexSPSCFifo() {
         while (!empty()) {
-            allocator_traits::destroy(*this, &ring_[popCursor_ % Capacity]);
+            allocator_traits::destroy(*this, &ring_[popCursor_ % capacity()]);
             ++popCursor_;
         }
-        allocator_traits::deallocate(*this, ring_, Capacity);
+        allocator_traits::deallocate(*this, ring_, capacity());
     }
 
     // Delete the copy constructor, we don't want that.
     MutexSPSCFifo(const MutexSPSCFifo&) = delete;
     MutexSPSCFifo& operator=(const MutexSPSCFifo&) = delete;
 
-    [[nodiscard]] constexpr auto capacity() const {
-        return Capacity;
+    [[nodiscard]] constexpr std::size_t capacity() const {
+        if constexpr (dynamicCapacity)
+            return capacity_;
+        else
+            return Capacity;
     }
 
     [[nodiscard]] auto size() const {
@@ -75,7 +93,7 @@ public:
         std::unique_lock lk(mtx_);
         cv_.wait(lk, [this]{ return !this->noLockFull(); });
 
-        allocator_traits::construct(*this, &ring_[pushCursor_ % Capacity], value);
+        allocator_traits::construct(*this, &ring_[pushCursor_ % capacity()], value);
         ++pushCursor_;
 
         lk.unlock();
@@ -86,8 +104,8 @@ public:
         std::unique_lock lk(mtx_);
         cv_.wait(lk, [this]{ return !this->noLockEmpty(); });
 
-        auto val = std::move(ring_[popCursor_ % Capacity]);
-        allocator_traits::destroy(*this, &ring_[popCursor_ % Capacity]);
+        auto val = std::move(ring_[popCursor_ % capacity()]);
+        allocator_traits::destroy(*this, &ring_[popCursor_ % capacity()]);
         ++popCursor_;
 
         lk.unlock();
@@ -100,7 +118,7 @@ public:
         if (noLockFull())
             return false;
 
-        allocator_traits::construct(*this, &ring_[pushCursor_ % Capacity], value);
+        allocator_traits::construct(*this, &ring_[pushCursor_ % capacity()], value);
         ++pushCursor_;
 
         return true;
@@ -111,11 +129,67 @@ public:
         if (noLockEmpty())
             return std::nullopt;
 
-        auto val = std::move(ring_[popCursor_ % Capacity]);
-        allocator_traits::destroy(*this, &ring_[popCursor_ % Capacity]);
+        auto val = std::move(ring_[popCursor_ % capacity()]);
+        allocator_traits::destroy(*this, &ring_[popCursor_ % capacity()]);
         ++popCursor_;
 
         return val;
     }
 
+    // The zero-copy producer side. reserve() waits for and returns the next free slot,
+    // as raw memory to construct the element in, for example with std::construct_at.
+    // commit() then publishes it. As there is a single producer, nobody else touches
+    // the slot until we commit, so we only hold the lock to look at the cursors.
+    [[nodiscard]] T* reserve() {
+        std::unique_lock lk(mtx_);
+        cv_.wait(lk, [this]{ return !this->noLockFull(); });
+
+        return &ring_[pushCursor_ % capacity()];
+    }
+
+    // Same as reserve, but returns nullptr rather than waiting when full.
+    [[nodiscard]] T* try_reserve() {
+        std::scoped_lock lk(mtx_);
+        if (noLockFull())
+            return nullptr;
+
+        return &ring_[pushCursor_ % capacity()];
+    }
+
+    // Publishes the element constructed in the slot given by reserve.
+    void commit() {
+        std::unique_lock lk(mtx_);
+        ++pushCursor_;
+
+        lk.unlock();
+        cv_.notify_one();
+    }
+
+    // The zero-copy consumer side. front() waits for and returns the oldest element,
+    // which stays in the ring until release() destroys it.
+    [[nodiscard]] T* front() {
+        std::unique_lock lk(mtx_);
+        cv_.wait(lk, [this]{ return !this->noLockEmpty(); });
+
+        return &ring_[popCursor_ % capacity()];
+    }
+
+    // Same as front, but returns nullptr rather than waiting when empty.
+    [[nodiscard]] T* try_front() {
+        std::scoped_lock lk(mtx_);
+        if (noLockEmpty())
+            return nullptr;
+
+        return &ring_[popCursor_ % capacity()];
+    }
+
+    // Destroys the element given by front, and frees its slot.
+    void release() {
+        std::unique_lock lk(mtx_);
+        allocator_traits::destroy(*this, &ring_[popCursor_ % capacity()]);
+        ++popCursor_;
+
+        lk.unlock();
+        cv_.notify_one();
+    }
 };
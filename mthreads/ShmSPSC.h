@@ -0,0 +1,389 @@
+#pragma once
+
+// An SPSC fifo in shared memory, so that the producer and consumer can be in
+// different processes.
+//
+// Everything the two sides share, the cursors, the parked flags and the ring, is
+// in one mapping, a memfd or a POSIX shared memory object. The header only holds
+// offsets, never pointers, so each process can map it wherever it likes. The
+// cached cursors are in the handle, as each side keeps its own.
+//
+// The elements are copied between address spaces as bytes, so they must be
+// trivially copyable, and not hold pointers unless they point into shared memory.
+//
+// Waiting is like HybridWait: spin, yield, and then sleep on a futex. That can't be
+// std::atomic::wait, as libstdc++ uses private futexes for it, and for 8 byte types
+// a table of waiters in the process, neither of which is seen by another process.
+// So the sleeper waits on its parked flag, with the futex syscall, shared.
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "WaitPolicy.h"
+
+namespace detail {
+
+[[nodiscard]] inline std::runtime_error errnoError(const std::string& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t) && std::atomic<std::uint32_t>::is_always_lock_free,
+    "The futex word has to be a plain 32 bit word");
+
+// Sleeps as long as word is expected. Can return early, so check again after.
+inline void futexWaitShared(std::atomic<std::uint32_t>& word, const std::uint32_t expected) {
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAIT, expected, nullptr, nullptr, 0);
+}
+
+inline void futexWakeShared(std::atomic<std::uint32_t>& word) {
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+}
+
+template <typename T, std::size_t Spins = 1024, std::size_t Yields = 64>
+class ShmSPSCFifo final {
+public:
+#ifdef __cpp_lib_hardware_interference_size
+    static constexpr std::size_t destructiveInterference = std::hardware_destructive_interference_size;
+#else
+    static constexpr std::size_t destructiveInterference = 64;
+#endif
+
+private:
+    static_assert(std::is_trivially_copyable_v<T>, "The elements are shared between processes as bytes");
+    static_assert(std::atomic<std::size_t>::is_always_lock_free,
+        "Only lock free atomics are guaranteed to work between processes");
+
+    // "SPSCFIFO", so that we don't map something that isn't ours.
+    static constexpr std::uint64_t headerMagic = 0x4f464946'43535053;
+    static constexpr std::uint32_t headerVersion = 1;
+
+    struct Header {
+        // Written last by the creator, so that an opener knows the rest is there.
+        std::atomic<std::uint64_t> magic;
+        std::uint32_t version;
+        std::uint32_t elementSize;
+        std::uint64_t capacity;
+        std::uint64_t ringOffset;
+
+        alignas(destructiveInterference) std::atomic<std::size_t> pushCursor;
+        alignas(destructiveInterference) std::atomic<std::size_t> popCursor;
+
+        // 1 while the side sleeps in the futex, and the futex words themselves.
+        alignas(destructiveInterference) std::atomic<std::uint32_t> producerParked;
+        alignas(destructiveInterference) std::atomic<std::uint32_t> consumerParked;
+    };
+
+    // The ring starts on a line of its own.
+    static constexpr std::size_t ringAlign = std::max(alignof(T), destructiveInterference);
+    static constexpr std::size_t ringOffset = (sizeof(Header) + ringAlign - 1) / ringAlign * ringAlign;
+
+    int fd_{-1};
+    std::byte* base_{nullptr};
+    std::size_t mappedSize_{0};
+    // Set for a named fifo we created, which we then unlink when done.
+    std::string unlinkName_;
+
+    Header* header_{nullptr};
+    T* ring_{nullptr};
+    std::size_t mask_{0};
+
+    alignas(destructiveInterference) std::size_t cachedPopCursor_{0};
+    alignas(destructiveInterference) std::size_t cachedPushCursor_{0};
+
+    [[nodiscard]] static std::size_t mappingSize(const std::size_t capacity) {
+        return ringOffset + capacity * sizeof(T);
+    }
+
+    // Sizes the object behind fd and lays out an empty fifo in it.
+    static void initialize(const int fd, const std::size_t minCapacity) {
+        const auto capacity = std::bit_ceil(std::max<std::size_t>(minCapacity, 1));
+        const auto size = mappingSize(capacity);
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+            throw detail::errnoError("ftruncate of shared fifo");
+
+        void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED)
+            throw detail::errnoError("mmap of shared fifo");
+
+        auto* header = ::new (mem) Header{};
+        header->version = headerVersion;
+        header->elementSize = sizeof(T);
+        header->capacity = capacity;
+        header->ringOffset = ringOffset;
+        header->magic.store(headerMagic, std::memory_order::release);
+
+        munmap(mem, size);
+    }
+
+    // Maps the fifo behind fd, which we then own, and checks that it is one of ours.
+    ShmSPSCFifo(const int fd, std::string unlinkName) : fd_{fd}, unlinkName_{std::move(unlinkName)} {
+        // The destructor won't run, so we clean up ourselves.
+        const auto fail = [this](const std::runtime_error& e) {
+            release();
+            throw e;
+        };
+
+        struct stat st{};
+        if (fstat(fd_, &st) != 0)
+            fail(detail::errnoError("fstat of shared fifo"));
+
+        mappedSize_ = static_cast<std::size_t>(st.st_size);
+        if (mappedSize_ < sizeof(Header))
+            fail(std::runtime_error("The shared memory is too small to be a fifo"));
+
+        void* mem = mmap(nullptr, mappedSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (mem == MAP_FAILED)
+            fail(detail::errnoError("mmap of shared fifo"));
+        base_ = static_cast<std::byte*>(mem);
+
+        header_ = std::launder(reinterpret_cast<Header*>(base_));
+        if (header_->magic.load(std::memory_order::acquire) != headerMagic || header_->version != headerVersion ||
+            header_->elementSize != sizeof(T) || header_->ringOffset != ringOffset ||
+            !std::has_single_bit(header_->capacity) || mappedSize_ < mappingSize(header_->capacity)) {
+            fail(std::runtime_error("The shared memory does not hold a fifo of this type"));
+        }
+
+        ring_ = std::launder(reinterpret_cast<T*>(base_ + header_->ringOffset));
+        mask_ = header_->capacity - 1;
+        cachedPopCursor_ = header_->popCursor.load(std::memory_order::acquire);
+        cachedPushCursor_ = header_->pushCursor.load(std::memory_order::acquire);
+    }
+
+    void release() {
+        if (base_ != nullptr)
+            munmap(base_, mappedSize_);
+        if (fd_ != -1)
+            close(fd_);
+        if (!unlinkName_.empty())
+            shm_unlink(unlinkName_.c_str());
+
+        base_ = nullptr;
+        fd_ = -1;
+        unlinkName_.clear();
+    }
+
+    [[nodiscard]] T* element(const std::size_t cursor) {
+        return ring_ + (cursor & mask_);
+    }
+
+    // Waits for cursor to move on from old, like HybridWait does, but with a futex
+    // that works between processes.
+    static std::size_t wait(const std::atomic<std::size_t>& cursor, const std::size_t old, std::atomic<std::uint32_t>& parked) {
+        std::size_t cur;
+        for (std::size_t i = 0; i < Spins; i++) {
+            if ((cur = cursor.load(std::memory_order::acquire)) != old)
+                return cur;
+            detail::cpuRelax();
+        }
+
+        for (std::size_t i = 0; i < Yields; i++) {
+            if ((cur = cursor.load(std::memory_order::acquire)) != old)
+                return cur;
+            std::this_thread::yield();
+        }
+
+        while (true) {
+            // This pairs with the fence in notify: either it sees that we are parked,
+            // or we see the new cursor here.
+            parked.store(1, std::memory_order::relaxed);
+            std::atomic_thread_fence(std::memory_order::seq_cst);
+
+            if ((cur = cursor.load(std::memory_order::acquire)) != old) {
+                parked.store(0, std::memory_order::relaxed);
+                return cur;
+            }
+
+            detail::futexWaitShared(parked, 1);
+        }
+    }
+
+    // Wakes the other side if it is asleep. Clearing the flag first means that if it
+    // hasn't gone into the futex yet, it won't.
+    static void notify(std::atomic<std::uint32_t>& parked) {
+        std::atomic_thread_fence(std::memory_order::seq_cst);
+        if (parked.load(std::memory_order::relaxed) != 0) {
+            parked.store(0, std::memory_order::relaxed);
+            detail::futexWakeShared(parked);
+        }
+    }
+
+public:
+    // Creates an anonymous fifo in a memfd. Another process gets to it through the
+    // fd, either inherited over fork or passed over a unix socket, and fromFd.
+    explicit ShmSPSCFifo(const std::size_t minCapacity) {
+        const int fd = memfd_create("ShmSPSCFifo", MFD_CLOEXEC);
+        if (fd == -1)
+            throw detail::errnoError("memfd_create");
+
+        try {
+            initialize(fd, minCapacity);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+
+        *this = ShmSPSCFifo(fd, {});
+    }
+
+    // Creates a fifo as the POSIX shared memory object name, like "/my-fifo", which
+    // must not exist already. It is unlinked again when this is destroyed.
+    [[nodiscard]] static ShmSPSCFifo create(const std::string& name, const std::size_t minCapacity) {
+        const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd == -1)
+            throw detail::errnoError("shm_open of " + name);
+
+        try {
+            initialize(fd, minCapacity);
+        } catch (...) {
+            close(fd);
+            shm_unlink(name.c_str());
+            throw;
+        }
+
+        return ShmSPSCFifo(fd, name);
+    }
+
+    // Opens the fifo another process created with create.
+    [[nodiscard]] static ShmSPSCFifo open(const std::string& name) {
+        const int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd == -1)
+            throw detail::errnoError("shm_open of " + name);
+
+        return ShmSPSCFifo(fd, {});
+    }
+
+    // Maps the fifo behind fd again, which we don't take over.
+    [[nodiscard]] static ShmSPSCFifo fromFd(const int fd) {
+        const int dup = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (dup == -1)
+            throw detail::errnoError("dup of shared fifo");
+
+        return ShmSPSCFifo(dup, {});
+    }
+
+    ~ShmSPSCFifo() {
+        release();
+    }
+
+    ShmSPSCFifo(ShmSPSCFifo&& other) noexcept {
+        *this = std::move(other);
+    }
+
+    ShmSPSCFifo& operator=(ShmSPSCFifo&& other) noexcept {
+        if (this != &other) {
+            release();
+            fd_ = std::exchange(other.fd_, -1);
+            base_ = std::exchange(other.base_, nullptr);
+            mappedSize_ = other.mappedSize_;
+            unlinkName_ = std::exchange(other.unlinkName_, {});
+            header_ = other.header_;
+            ring_ = other.ring_;
+            mask_ = other.mask_;
+            cachedPopCursor_ = other.cachedPopCursor_;
+            cachedPushCursor_ = other.cachedPushCursor_;
+        }
+        return *this;
+    }
+
+    ShmSPSCFifo(const ShmSPSCFifo&) = delete;
+    ShmSPSCFifo& operator=(const ShmSPSCFifo&) = delete;
+
+    [[nodiscard]] int fd() const {
+        return fd_;
+    }
+
+    // Where the header is mapped in this process, to show that it differs between them.
+    [[nodiscard]] const void* address() const {
+        return base_;
+    }
+
+    [[nodiscard]] std::size_t capacity() const {
+        return mask_ + 1;
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return header_->pushCursor.load(std::memory_order::acquire) - header_->popCursor.load(std::memory_order::acquire);
+    }
+
+    [[nodiscard]] bool empty() const {
+        return size() == 0;
+    }
+
+    [[nodiscard]] bool full() const {
+        return size() == capacity();
+    }
+
+    void push(const T& value) {
+        const auto curPush = header_->pushCursor.load(std::memory_order::relaxed);
+        if (curPush - cachedPopCursor_ == capacity())
+            cachedPopCursor_ = wait(header_->popCursor, cachedPopCursor_, header_->producerParked);
+
+        ::new (static_cast<void*>(element(curPush))) T(value);
+
+        header_->pushCursor.store(curPush + 1, std::memory_order::release);
+        notify(header_->consumerParked);
+    }
+
+    [[nodiscard]] bool try_push(const T& value) {
+        const auto curPush = header_->pushCursor.load(std::memory_order::relaxed);
+        if (curPush - cachedPopCursor_ == capacity()) {
+            cachedPopCursor_ = header_->popCursor.load(std::memory_order::acquire);
+            if (curPush - cachedPopCursor_ == capacity())
+                return false;
+        }
+
+        ::new (static_cast<void*>(element(curPush))) T(value);
+
+        header_->pushCursor.store(curPush + 1, std::memory_order::release);
+        notify(header_->consumerParked);
+        return true;
+    }
+
+    T pop() {
+        const auto curPop = header_->popCursor.load(std::memory_order::relaxed);
+        if (curPop == cachedPushCursor_)
+            cachedPushCursor_ = wait(header_->pushCursor, cachedPushCursor_, header_->consumerParked);
+
+        const T val = *element(curPop);
+
+        header_->popCursor.store(curPop + 1, std::memory_order::release);
+        notify(header_->producerParked);
+        return val;
+    }
+
+    [[nodiscard]] std::optional<T> try_pop() {
+        const auto curPop = header_->popCursor.load(std::memory_order::relaxed);
+        if (curPop == cachedPushCursor_) {
+            cachedPushCursor_ = header_->pushCursor.load(std::memory_order::acquire);
+            if (curPop == cachedPushCursor_)
+                return std::nullopt;
+        }
+
+        const T val = *element(curPop);
+
+        header_->popCursor.store(curPop + 1, std::memory_order::release);
+        notify(header_->producerParked);
+        return val;
+    }
+};
@@ -0,0 +1,327 @@
+#pragma once
+
+// A work-stealing thread pool for fork-join parallelism.
+//
+// Every worker has its own ChaseLevDeque, where the tasks it spawns go. It works
+// through its own deque newest first, and only when that is empty does it look at
+// the global injection queue, where tasks from outside the pool go, and then try
+// to steal the oldest task of a random other worker. Waiting for a TaskGroup
+// doesn't block, it runs other tasks until the group is done, which is what makes
+// recursive fork-join work without running out of threads.
+//
+// Idle workers spin for a while, then yield, and finally sleep on a futex. The
+// spawning side only pays for a wakeup when someone is actually asleep.
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+
+#include "AtomicMPMC.h"
+#include "ChaseLevDeque.h"
+#include "WaitPolicy.h"
+
+class ThreadPool {
+    struct Task {
+        virtual ~Task() = default;
+        virtual void run() = 0;
+    };
+
+    template <typename F>
+    struct FnTask final : Task {
+        F fn;
+
+        explicit FnTask(F f) : fn{std::move(f)} {}
+
+        void run() override {
+            fn();
+        }
+    };
+
+    struct alignas(64) Worker {
+        ChaseLevDeque<Task*> deque;
+        std::uint64_t rng{0};
+    };
+
+    // Which pool and worker the current thread is, if any. Being thread_local,
+    // it starts out zeroed.
+    struct Current {
+        const ThreadPool* pool;
+        std::size_t index;
+    };
+    static inline thread_local Current current_;
+
+    static constexpr std::size_t spinRounds = 64;
+    static constexpr std::size_t yieldRounds = 16;
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    AtomicMPMCFifo<Task*, 4096> injection_;
+    std::vector<std::thread> threads_;
+
+    alignas(64) std::atomic<std::uint32_t> epoch_{0};
+    alignas(64) std::atomic<std::uint32_t> sleepers_{0};
+    std::atomic<bool> stop_{false};
+
+    [[nodiscard]] std::optional<std::size_t> currentIndex() const {
+        if (current_.pool == this)
+            return current_.index;
+        return std::nullopt;
+    }
+
+    // Wakes a sleeping worker, if there is one. The fence pairs with the sleeper
+    // registering itself before its last look for work.
+    void wake() {
+        std::atomic_thread_fence(std::memory_order::seq_cst);
+        if (sleepers_.load(std::memory_order::relaxed) != 0) {
+            epoch_.fetch_add(1, std::memory_order::release);
+            epoch_.notify_one();
+        }
+    }
+
+    void enqueue(Task* task) {
+        if (const auto idx = currentIndex()) {
+            workers_[*idx]->deque.push(task);
+        } else {
+            injection_.push(task);
+        }
+        wake();
+    }
+
+    [[nodiscard]] Task* findTask() {
+        const auto idx = currentIndex();
+        if (idx) {
+            if (const auto task = workers_[*idx]->deque.pop())
+                return *task;
+        }
+
+        if (const auto task = injection_.try_pop())
+            return *task;
+
+        // Start at a random victim, so that the thieves spread out.
+        const auto n = workers_.size();
+        std::size_t start = 0;
+        if (idx) {
+            auto& x = workers_[*idx]->rng;
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            start = static_cast<std::size_t>(x % n);
+        }
+
+        for (std::size_t i = 0; i < n; i++) {
+            const auto victim = (start + i) % n;
+            if (idx && victim == *idx)
+                continue;
+            if (const auto task = workers_[victim]->deque.steal())
+                return *task;
+        }
+
+        return nullptr;
+    }
+
+    void workerLoop(const std::size_t index) {
+        current_ = Current{this, index};
+
+        std::size_t idle = 0;
+        while (true) {
+            const auto seen = epoch_.load(std::memory_order::acquire);
+            if (runOne()) {
+                idle = 0;
+                continue;
+            }
+
+            if (stop_.load(std::memory_order::acquire))
+                break;
+
+            idle++;
+            if (idle < spinRounds) {
+                detail::cpuRelax();
+            } else if (idle < spinRounds + yieldRounds) {
+                std::this_thread::yield();
+            } else {
+                sleepers_.fetch_add(1, std::memory_order::seq_cst);
+                // One last look, now that any spawner is sure to see us.
+                if (!runOne() && !stop_.load(std::memory_order::acquire))
+                    epoch_.wait(seen, std::memory_order::acquire);
+                sleepers_.fetch_sub(1, std::memory_order::relaxed);
+                idle = 0;
+            }
+        }
+
+        current_ = Current{};
+    }
+
+public:
+    // Starts threads workers, pinned to a cpu each when pin is set, like the benchmarks.
+    explicit ThreadPool(std::size_t threads = std::thread::hardware_concurrency(), const bool pin = true) {
+        threads = std::max<std::size_t>(threads, 1);
+        const auto cores = std::max(1u, std::thread::hardware_concurrency());
+
+        for (std::size_t i = 0; i < threads; i++) {
+            workers_.push_back(std::make_unique<Worker>());
+            workers_.back()->rng = 0x9E3779B97F4A7C15ull * (i + 1);
+        }
+
+        for (std::size_t i = 0; i < threads; i++) {
+            threads_.emplace_back([this, i]() { workerLoop(i); });
+
+            if (pin) {
+                cpu_set_t cpuset;
+                CPU_ZERO(&cpuset);
+                CPU_SET(static_cast<int>(i % cores), &cpuset);
+                const int rc = pthread_setaffinity_np(threads_.back().native_handle(), sizeof(cpu_set_t), &cpuset);
+                if (rc != 0) {
+                    std::cerr << "Error calling pthread_setaffinity_np: " << rc << "\n";
+                }
+            }
+        }
+    }
+
+    // Runs everything that is already queued, and then stops the workers.
+    ~ThreadPool() {
+        stop_.store(true, std::memory_order::release);
+        epoch_.fetch_add(1, std::memory_order::release);
+        epoch_.notify_all();
+
+        for (auto& t : threads_)
+            t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    [[nodiscard]] std::size_t size() const {
+        return workers_.size();
+    }
+
+    // Runs one queued task on the calling thread, if there is one. Anyone waiting
+    // on the pool should do this rather than block.
+    bool runOne() {
+        Task* task = findTask();
+        if (task == nullptr)
+            return false;
+
+        std::unique_ptr<Task>{task}->run();
+        return true;
+    }
+
+    // Runs fn on the pool without waiting for it, for fire and forget work.
+    template <typename F>
+    void spawn(F fn) {
+        enqueue(new FnTask<F>(std::move(fn)));
+    }
+
+    // Runs fn on the pool, and returns a future for its result. Don't block on the
+    // future from inside the pool, use a TaskGroup for that.
+    template <typename F>
+    [[nodiscard]] auto submit(F fn) -> std::future<std::invoke_result_t<F>> {
+        using R = std::invoke_result_t<F>;
+        auto task = std::make_shared<std::packaged_task<R()>>(std::move(fn));
+        auto future = task->get_future();
+        spawn([task = std::move(task)]() { (*task)(); });
+        return future;
+    }
+
+    // Calls body(lo, hi) for pieces of [begin, end) of at most grain elements, and
+    // returns when they are all done. The range is split in halves, so that the
+    // first steals take the biggest pieces.
+    template <typename F>
+    void parallel_for(std::size_t begin, std::size_t end, std::size_t grain, const F& body);
+};
+
+// A set of tasks that can be waited for together, from inside or outside the pool.
+// The first exception thrown by a task is rethrown by wait.
+class TaskGroup {
+    ThreadPool& pool_;
+    std::atomic<std::size_t> pending_{0};
+
+    std::mutex errorMtx_;
+    std::exception_ptr error_;
+
+public:
+    explicit TaskGroup(ThreadPool& pool) : pool_{pool} {}
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    ~TaskGroup() {
+        // The tasks refer to us, so we can't go before they do.
+        while (pending_.load(std::memory_order::acquire) != 0)
+            if (!pool_.runOne())
+                std::this_thread::yield();
+    }
+
+    template <typename F>
+    void run(F fn) {
+        pending_.fetch_add(1, std::memory_order::relaxed);
+        pool_.spawn([this, task = std::optional<F>(std::move(fn))]() mutable {
+            try {
+                (*task)();
+            } catch (...) {
+                std::scoped_lock lk(errorMtx_);
+                if (!error_)
+                    error_ = std::current_exception();
+            }
+
+            // The captures of fn can refer to the caller, which may be gone as soon
+            // as wait sees we are done, so they go first.
+            task.reset();
+            pending_.fetch_sub(1, std::memory_order::release);
+        });
+    }
+
+    void wait() {
+        std::size_t idle = 0;
+        while (pending_.load(std::memory_order::acquire) != 0) {
+            if (pool_.runOne()) {
+                idle = 0;
+            } else if (++idle < 64) {
+                detail::cpuRelax();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+
+        std::scoped_lock lk(errorMtx_);
+        if (error_)
+            std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+};
+
+namespace detail {
+
+template <typename F>
+void splitFor(TaskGroup& group, std::size_t begin, std::size_t end, const std::size_t grain, const F& body) {
+    while (grain < end - begin) {
+        const auto mid = begin + (end - begin) / 2;
+        group.run([&group, mid, end, grain, &body]() { splitFor(group, mid, end, grain, body); });
+        end = mid;
+    }
+
+    body(begin, end);
+}
+
+}
+
+template <typename F>
+void ThreadPool::parallel_for(const std::size_t begin, const std::size_t end, std::size_t grain, const F& body) {
+    if (end <= begin)
+        return;
+
+    grain = std::max<std::size_t>(grain, 1);
+    TaskGroup group(*this);
+    detail::splitFor(group, begin, end, grain, body);
+    group.wait();
+}
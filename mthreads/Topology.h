@@ -0,0 +1,159 @@
+#pragma once
+
+// Reads the CPU topology from /sys/devices/system/cpu, so that the benchmarks can
+// pick their CPU pairs by how far apart they are, rather than by hard-coded
+// numbers that only mean something on one machine.
+
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct CpuInfo {
+    int cpu;
+    int package;
+    int core;
+    // The lowest cpu sharing the L3 with this one, which makes a fine id.
+    int l3;
+    int node;
+};
+
+// Two CPUs for the sender and receiver, with what they share.
+struct CpuPair {
+    std::string kind;
+    int sendCpu;
+    int recvCpu;
+};
+
+namespace detail {
+
+// Parses a cpu list like "0-3,8,10-11".
+[[nodiscard]] inline std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n")
+            continue;
+
+        const auto dash = range.find('-');
+        const int first = std::stoi(range.substr(0, dash));
+        const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int c = first; c <= last; c++)
+            cpus.push_back(c);
+    }
+    return cpus;
+}
+
+[[nodiscard]] inline std::optional<std::string> readLine(const std::filesystem::path& path) {
+    std::ifstream in(path);
+    std::string line;
+    if (!in || !std::getline(in, line))
+        return std::nullopt;
+    return line;
+}
+
+[[nodiscard]] inline int readInt(const std::filesystem::path& path, const int fallback) {
+    const auto line = readLine(path);
+    return line && !line->empty() ? std::stoi(*line) : fallback;
+}
+
+}
+
+class CpuTopology {
+    std::vector<CpuInfo> cpus_;
+
+public:
+    // Reads the topology of the online CPUs. When the kernel doesn't say, every CPU
+    // is taken to be its own core, sharing a single L3 and NUMA node with the rest.
+    [[nodiscard]] static CpuTopology read(const std::filesystem::path& root = "/sys/devices/system/cpu") {
+        namespace fs = std::filesystem;
+
+        CpuTopology topo;
+        const auto online = detail::readLine(root / "online");
+        for (const int cpu : detail::parseCpuList(online.value_or("0"))) {
+            const auto dir = root / ("cpu" + std::to_string(cpu));
+
+            CpuInfo info{cpu, 0, cpu, 0, 0};
+            info.package = detail::readInt(dir / "topology" / "physical_package_id", 0);
+            info.core = detail::readInt(dir / "topology" / "core_id", cpu);
+
+            std::error_code ec;
+            for (const auto& entry : fs::directory_iterator(dir / "cache", ec)) {
+                if (detail::readInt(entry.path() / "level", 0) != 3)
+                    continue;
+                if (const auto shared = detail::readLine(entry.path() / "shared_cpu_list")) {
+                    const auto list = detail::parseCpuList(*shared);
+                    if (!list.empty())
+                        info.l3 = list.front();
+                }
+            }
+
+            for (const auto& entry : fs::directory_iterator(dir, ec)) {
+                const auto name = entry.path().filename().string();
+                if (name.starts_with("node") && 4 < name.size())
+                    info.node = std::stoi(name.substr(4));
+            }
+
+            topo.cpus_.push_back(info);
+        }
+
+        return topo;
+    }
+
+    [[nodiscard]] const std::vector<CpuInfo>& cpus() const {
+        return cpus_;
+    }
+
+    // Finds one pair of each kind this machine has:
+    //  - smt: two hyperthreads of the same core
+    //  - l3: two cores sharing an L3
+    //  - cross-l3: two cores on the same NUMA node, with different L3s
+    //  - cross-numa: two cores on different NUMA nodes
+    // We search from the highest CPUs down, as CPU 0 tends to get the interrupts.
+    // On a machine with none of these, we fall back to a single same-cpu pair.
+    [[nodiscard]] std::vector<CpuPair> pairs() const {
+        struct Kind {
+            const char* name;
+            bool (*match)(const CpuInfo&, const CpuInfo&);
+        };
+        static constexpr Kind kinds[] = {
+            {"smt", [](const CpuInfo& a, const CpuInfo& b) { return a.package == b.package && a.core == b.core; }},
+            {"l3", [](const CpuInfo& a, const CpuInfo& b) { return a.l3 == b.l3 && !(a.package == b.package && a.core == b.core); }},
+            {"cross-l3", [](const CpuInfo& a, const CpuInfo& b) { return a.l3 != b.l3 && a.node == b.node; }},
+            {"cross-numa", [](const CpuInfo& a, const CpuInfo& b) { return a.node != b.node; }},
+        };
+
+        std::vector<CpuPair> found;
+        for (const auto& kind : kinds) {
+            bool done = false;
+            for (auto a = cpus_.rbegin(); a != cpus_.rend() && !done; ++a) {
+                for (auto b = a + 1; b != cpus_.rend() && !done; ++b) {
+                    if (kind.match(*a, *b)) {
+                        found.push_back(CpuPair{kind.name, b->cpu, a->cpu});
+                        done = true;
+                    }
+                }
+            }
+        }
+
+        if (found.empty()) {
+            const int cpu = cpus_.empty() ? 0 : cpus_.front().cpu;
+            found.push_back(CpuPair{"same-cpu", cpu, cpu});
+        }
+
+        return found;
+    }
+
+    // The pair of the given kind, or the closest pair we have if there is none.
+    [[nodiscard]] CpuPair pair(const std::string& kind) const {
+        const auto all = pairs();
+        for (const auto& p : all)
+            if (p.kind == kind)
+                return p;
+        return all.front();
+    }
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+// How one side of AtomicSPSCFifo waits for the other, when the ring is full or empty.
+//
+// A policy has a static wait(cursor, old, parked), which returns the value of
+// cursor once it is no longer old, and a static parks, which says if wait can ever
+// go to sleep in the futex. If it can, it sets parked while asleep, and the other
+// side then has to notify it. Both sides of a fifo use the same policy.
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace detail {
+
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+}
+
+}
+
+// Spins on the cursor as hard as it can. The lowest latency, but it burns a whole
+// core and starves a hyperthread sibling.
+struct BusySpinWait {
+    static constexpr bool parks = false;
+
+    static std::size_t wait(const std::atomic<std::size_t>& cursor, const std::size_t old, std::atomic<bool>&) {
+        std::size_t cur;
+        while ((cur = cursor.load(std::memory_order::acquire)) == old) {}
+        return cur;
+    }
+};
+
+// Spins with a pause between every look, which gives the core to a hyperthread
+// sibling and avoids the memory order mis-speculation when the cursor changes.
+struct PauseSpinWait {
+    static constexpr bool parks = false;
+
+    static std::size_t wait(const std::atomic<std::size_t>& cursor, const std::size_t old, std::atomic<bool>&) {
+        std::size_t cur;
+        while ((cur = cursor.load(std::memory_order::acquire)) == old)
+            detail::cpuRelax();
+        return cur;
+    }
+};
+
+// Spins Spins times, yields Yields times and then sleeps in the futex until
+// notified. Short gaps are then caught while spinning, and long ones cost no CPU.
+template <std::size_t Spins = 1024, std::size_t Yields = 64>
+struct HybridWait {
+    static constexpr bool parks = true;
+
+    static std::size_t wait(const std::atomic<std::size_t>& cursor, const std::size_t old, std::atomic<bool>& parked) {
+        std::size_t cur;
+        for (std::size_t i = 0; i < Spins; i++) {
+            if ((cur = cursor.load(std::memory_order::acquire)) != old)
+                return cur;
+            detail::cpuRelax();
+        }
+
+        for (std::size_t i = 0; i < Yields; i++) {
+            if ((cur = cursor.load(std::memory_order::acquire)) != old)
+                return cur;
+            std::this_thread::yield();
+        }
+
+        while (true) {
+            // This pairs with the fence in the notifying side: either it sees that we
+            // are parked, or we see the new cursor here, so a wakeup is never lost.
+            parked.store(true, std::memory_order::relaxed);
+            std::atomic_thread_fence(std::memory_order::seq_cst);
+
+            if ((cur = cursor.load(std::memory_order::acquire)) != old) {
+                parked.store(false, std::memory_order::relaxed);
+                return cur;
+            }
+
+            cursor.wait(old, std::memory_order::acquire);
+        }
+    }
+};
+
+// Goes straight to sleep, but unlike push_futex and pop_futex the other side only
+// calls notify when we are actually asleep.
+using FutexWait = HybridWait<0, 0>;
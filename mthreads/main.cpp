@@ -1,18 +1,52 @@
+// Benchmarks for the queues and the thread pool.
+//
+// By default this sends N messages through an SPSC queue on every kind of CPU pair
+// this machine has, repeats each a number of times and prints the results as JSON.
+// With --mode latency or pingpong, it times every message as well, and adds their
+// percentiles to the results. The other experiments are run with --suite. See
+// --help for the options.
+
+#include <algorithm>
+#include <array>
+#include <charconv>
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
 #include <latch>
+#include <new>
+#include <numeric>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <vector>
 
+#include "AtomicMPMC.h"
+#include "AtomicMPSC.h"
 #include "AtomicSPSC.h"
+#include "Harness.h"
+#include "Latency.h"
 #include "MutexSPSC.h"
+#include "ShmSPSC.h"
+#include "ThreadPool.h"
+#include "Topology.h"
 
-#include "../third_party/SPSCQueue.h"
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-struct separate_thousands : std::numpunct<char> {
-    char_type do_thousands_sep() const override { return ','; }  // separate with commas
-    string_type do_grouping() const override { return "\3"; } // groups of 3 digit
-};
+#include "../matrix-kernels.h"
+#include "../vector2d.h"
 
+#include "../third_party/SPSCQueue.h"
 
 template <typename T>
 void preFlight() {
@@ -55,205 +89,444 @@ void preFlight() {
     std::cout << "passed in flight tests!" << std::endl;
 }
 
-template<typename T>
-std::size_t benchTrySemantics(T& fifo, const std::size_t N, const int sendCpu, const int recvCpu) {
-    std::latch all{3};
+enum class Semantics {
+    Wait,
+    Try,
+};
 
-    std::thread sender([&all, &fifo, N]() {
-        all.arrive_and_wait();
-        // std::cout << "Sender was started on thread: " << sched_getcpu() << std::endl;
+// Sends N messages of type M through fifo, with either the waiting push and pop,
+// or by retrying try_push and try_pop, and checks that they arrive in order.
+template<Semantics S, typename M, typename T>
+std::chrono::duration<double> benchSemantics(T& fifo, const std::size_t N, const CpuPair& pair) {
+    using Ops = QueueOps<T>;
 
-        std::size_t i = 1;
-        while (i <= N) {
-            if (fifo.try_push(i)) {
-                i++;
+    const auto diff = runPinnedPair(pair, [&fifo, N]() {
+        for (std::size_t i = 1; i <= N; i++) {
+            if constexpr (S == Semantics::Wait) {
+                Ops::push(fifo, makeMessage<M>(i));
+            } else {
+                const auto msg = makeMessage<M>(i);
+                while (!Ops::tryPush(fifo, msg)) {}
             }
         }
+        Ops::flush(fifo);
+    }, [&fifo, N]() {
+        for (std::size_t i = 1; i <= N; i++) {
+            M res;
+            if constexpr (S == Semantics::Wait) {
+                res = Ops::pop(fifo);
+            } else {
+                auto got = Ops::tryPop(fifo);
+                while (!got)
+                    got = Ops::tryPop(fifo);
+                res = std::move(*got);
+            }
 
+            if (!checkMessage(res, i)) {
+                std::cout << "We expected message " << i << ", but we got something else" << std::endl;
+                throw std::runtime_error("Our two numbers are not as expected!");
+            }
+        }
+        Ops::flushAcks(fifo);
     });
 
-    {
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        CPU_SET(sendCpu, &cpuset);
-        const int rc = pthread_setaffinity_np(sender.native_handle(), sizeof(cpu_set_t), &cpuset);
-        if (rc < 0) {
-            std::cerr << "Error calling pthread_setaffinity_np: " << rc << "\n";
-        }
+    // We now assert that the fifo is empty
+    if (!fifo.empty()) {
+        throw std::runtime_error("FIFO was not empty at the end of the run!");
     }
 
-    std::thread receiver([&fifo, &all, N]() {
-        all.arrive_and_wait();
-        // std::cout << "Receiver was started on thread: " << sched_getcpu() << std::endl;
+    return diff;
+}
 
-        std::size_t i = 1;
-        while (i <= N) {
-            auto res = fifo.try_pop();
-            if (res) {
-                if (*res != i) {
-                    std::cout << "We expected: " << i << ", but we got " << *res << std::endl;
+template<typename T>
+std::size_t benchTrySemantics(T& fifo, const std::size_t N, const CpuPair& pair) {
+    return reportRate("elements", N, benchSemantics<Semantics::Try, std::size_t>(fifo, N, pair));
+}
+
+template<typename T>
+std::size_t benchWaitSemantics(T& fifo, const std::size_t N, const CpuPair& pair) {
+    return reportRate("elements", N, benchSemantics<Semantics::Wait, std::size_t>(fifo, N, pair));
+}
+
+// Same as benchWaitSemantics, but the elements are sent and received batch at a time
+// with push_n and pop_n.
+template<typename T>
+std::size_t benchBatchWaitSemantics(T& fifo, const std::size_t N, const std::size_t batch, const CpuPair& pair) {
+    std::vector<std::size_t> sendBuf(batch);
+    std::vector<std::size_t> recvBuf(batch);
+
+    const auto diff = runPinnedPair(pair, [&fifo, &sendBuf, N, batch]() {
+        for (std::size_t i = 1; i <= N; i += batch) {
+            const auto n = std::min(batch, N - i + 1);
+            std::iota(sendBuf.begin(), sendBuf.begin() + static_cast<std::ptrdiff_t>(n), i);
+            fifo.push_n(std::span(sendBuf).first(n));
+        }
+    }, [&fifo, &recvBuf, N, batch]() {
+        for (std::size_t i = 1; i <= N; i += batch) {
+            const auto n = std::min(batch, N - i + 1);
+            fifo.pop_n(std::span(recvBuf).first(n));
+
+            for (std::size_t j = 0; j < n; j++) {
+                if (recvBuf[j] != i + j) {
+                    std::cout << "We expected: " << i + j << ", but we got " << recvBuf[j] << std::endl;
                     throw std::runtime_error("Our two numbers are not as expected!");
                 }
-                i++;
             }
         }
     });
 
-    {
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        CPU_SET(recvCpu, &cpuset);
-        const int rc = pthread_setaffinity_np(receiver.native_handle(), sizeof(cpu_set_t), &cpuset);
-        if (rc < 0) {
-            std::cerr << "Error calling pthread_setaffinity_np: " << rc << "\n";
-        }
+    // We now assert that the fifo is empty
+    if (!fifo.empty()) {
+        throw std::runtime_error("FIFO was not empty at the end of the run!");
     }
 
-    const auto beginTS = std::chrono::steady_clock::now();
-    all.arrive_and_wait();
-    // std::cout << "We started the sending!" << std::endl;
-    sender.join();
-    receiver.join();
-    const auto endTS = std::chrono::steady_clock::now();
+    return reportRate("elements in batches of " + std::to_string(batch), N, diff);
+}
+
+// Sends N payloads, filled and checked the same way in both modes. With ZeroCopy
+// the sender fills the slot it gets from reserve and the receiver reads it through
+// front, otherwise the payload is built on the stack, pushed and popped by value.
+template<bool ZeroCopy, typename P, typename T>
+std::size_t benchPayloadSemantics(T& fifo, const std::size_t N, const CpuPair& pair) {
+    const auto diff = runPinnedPair(pair, [&fifo, N]() {
+        for (std::size_t i = 1; i <= N; i++) {
+            if constexpr (ZeroCopy) {
+                // Default initialize, so that we don't pay for zeroing the data first.
+                P* p = ::new (static_cast<void*>(fifo.reserve())) P;
+                p->seq = i;
+                p->data.fill(static_cast<std::byte>(i));
+                fifo.commit();
+            } else {
+                fifo.push(makeMessage<P>(i));
+            }
+        }
+    }, [&fifo, N]() {
+        for (std::size_t i = 1; i <= N; i++) {
+            bool ok;
+            if constexpr (ZeroCopy) {
+                ok = checkMessage(*fifo.front(), i);
+                fifo.release();
+            } else {
+                ok = checkMessage(fifo.pop(), i);
+            }
+
+            if (!ok) {
+                std::cout << "We expected payload " << i << ", but we got something else" << std::endl;
+                throw std::runtime_error("Our two numbers are not as expected!");
+            }
+        }
+    });
 
     // We now assert that the fifo is empty
     if (!fifo.empty()) {
         throw std::runtime_error("FIFO was not empty at the end of the run!");
     }
 
-    const std::chrono::duration<double> diff = endTS - beginTS;
-
-    const auto perSecond = static_cast<std::size_t>(static_cast<double>(N) / diff.count());
+    return reportRate("payloads of " + std::to_string(sizeof(P)) + " bytes", N, diff);
+}
 
+// A message that carries the time it was sent, in the ticks of whichever clock the
+// benchmark uses, so the receiver can see how long it was in flight.
+struct Stamped {
+    std::size_t seq;
+    std::uint64_t sent;
+};
 
-    // std::cout << "The whole process took: " << diff << std::endl;
-    auto thousands = std::make_unique<separate_thousands>();
-    const auto prev = std::cout.imbue(std::locale(std::cout.getloc(), thousands.release()));
-    std::cout << "We sent " << N << " elements in " << std::setprecision(3) << diff << " making it: " << perSecond << " per second" << std::endl;
-    std::cout.imbue(prev);
+// The time from sent until now. Clocks of different cores can be a little apart,
+// which is better reported as 0 than as a wrap-around.
+template<typename Clock>
+[[nodiscard]] std::uint64_t elapsedNs(const Clock& clock, const std::uint64_t sent) {
+    const auto now = Clock::now();
+    return clock.toNs(sent < now ? now - sent : 0);
+}
 
-    return perSecond;
+[[nodiscard]] inline std::chrono::nanoseconds threadCpuTime() {
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
 }
 
-template<typename T>
-std::size_t benchWaitSemantics(T& fifo, const std::size_t N, const int sendCpu, const int recvCpu) {
-    std::latch all{3};
+// Sends bursts of burst messages with a sleep of gap between them, which is how
+// most of our queues are loaded in practice. Reports the latency of the messages,
+// and how much CPU each side used compared to the wall clock. With Futex, the
+// push_futex and pop_futex pair is used rather than the fifo's wait policy.
+template<bool Futex = false, typename T>
+void benchBurstySemantics(T& fifo, const std::size_t bursts, const std::size_t burst,
+                          const std::chrono::microseconds gap, const CpuPair& pair) {
+    const auto N = bursts * burst;
+    std::chrono::nanoseconds sendCpuTime{};
+    std::chrono::nanoseconds recvCpuTime{};
+    LatencyHistogram latency;
+
+    const auto diff = runPinnedPair(pair, [&fifo, &sendCpuTime, bursts, burst, gap]() {
+        const auto cpuBegin = threadCpuTime();
 
-    std::thread sender([&all, &fifo, N]() {
-        all.arrive_and_wait();
+        std::size_t i = 1;
+        for (std::size_t b = 0; b < bursts; b++) {
+            for (std::size_t j = 0; j < burst; j++, i++) {
+                const Stamped msg{i, SteadyClock::now()};
+                if constexpr (Futex)
+                    fifo.push_futex(msg);
+                else
+                    fifo.push(msg);
+            }
+            std::this_thread::sleep_for(gap);
+        }
 
-        for (std::size_t i = 1; i <= N; i++)
-            fifo.push(i);
-    });
+        sendCpuTime = threadCpuTime() - cpuBegin;
+    }, [&fifo, &recvCpuTime, &latency, N]() {
+        const auto cpuBegin = threadCpuTime();
 
-    {
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        CPU_SET(sendCpu, &cpuset);
-        const int rc = pthread_setaffinity_np(sender.native_handle(), sizeof(cpu_set_t), &cpuset);
-        if (rc < 0) {
-            std::cerr << "Error calling pthread_setaffinity_np: " << rc << "\n";
+        for (std::size_t i = 1; i <= N; i++) {
+            Stamped msg;
+            if constexpr (Futex)
+                msg = fifo.pop_futex();
+            else
+                msg = fifo.pop();
+
+            latency.record(elapsedNs(SteadyClock{}, msg.sent));
+            if (msg.seq != i) {
+                std::cout << "We expected: " << i << ", but we got " << msg.seq << std::endl;
+                throw std::runtime_error("Our two numbers are not as expected!");
+            }
         }
+
+        recvCpuTime = threadCpuTime() - cpuBegin;
+    });
+
+    // We now assert that the fifo is empty
+    if (!fifo.empty()) {
+        throw std::runtime_error("FIFO was not empty at the end of the run!");
     }
 
-    std::thread receiver([&fifo, &all, N]() {
-        all.arrive_and_wait();
+    const auto cpuShare = [&diff](const std::chrono::nanoseconds cpu) {
+        return 100.0 * std::chrono::duration<double>(cpu).count() / diff.count();
+    };
+
+    std::cout << "We sent " << N << " elements in bursts of " << burst << " in " << std::setprecision(3) << diff
+              << ", latency p50: " << latency.percentile(50) << "ns, p99: " << latency.percentile(99)
+              << "ns, p99.9: " << latency.percentile(99.9) << "ns, max: " << latency.max()
+              << "ns, cpu sender: " << cpuShare(sendCpuTime) << "%, receiver: " << cpuShare(recvCpuTime) << "%" << std::endl;
+}
+
+// Sends N messages stamped with clock as they are pushed, and records in latency how
+// long each took to be popped. With the producer going flat out, the queue is full
+// most of the time, so this is the latency of a saturated queue, waiting in line
+// included. benchPingPong measures an idle one.
+template<typename T, typename Clock>
+std::chrono::duration<double> benchLatency(T& fifo, const std::size_t N, const CpuPair& pair,
+                                           const Clock& clock, LatencyHistogram& latency) {
+    using Ops = QueueOps<T>;
+
+    const auto diff = runPinnedPair(pair, [&fifo, N]() {
+        for (std::size_t i = 1; i <= N; i++)
+            Ops::push(fifo, Stamped{i, Clock::now()});
+        Ops::flush(fifo);
+    }, [&fifo, &clock, &latency, N]() {
         for (std::size_t i = 1; i <= N; i++) {
-            auto res = fifo.pop();
-            if (res != i) {
-                    std::cout << "We expected: " << i << ", but we got " << res << std::endl;
-                    throw std::runtime_error("Our two numbers are not as expected!");
+            const Stamped msg = Ops::pop(fifo);
+            latency.record(elapsedNs(clock, msg.sent));
+
+            if (msg.seq != i) {
+                std::cout << "We expected: " << i << ", but we got " << msg.seq << std::endl;
+                throw std::runtime_error("Our two numbers are not as expected!");
             }
         }
+        Ops::flushAcks(fifo);
     });
 
-    {
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        CPU_SET(recvCpu, &cpuset);
-        const int rc = pthread_setaffinity_np(receiver.native_handle(), sizeof(cpu_set_t), &cpuset);
-        if (rc < 0) {
-            std::cerr << "Error calling pthread_setaffinity_np: " << rc << "\n";
-        }
-    }
-    const auto beginTS = std::chrono::steady_clock::now();
-    all.arrive_and_wait();
-    // std::cout << "We started the sending!" << std::endl;
-    sender.join();
-    receiver.join();
-    const auto endTS = std::chrono::steady_clock::now();
-
     // We now assert that the fifo is empty
     if (!fifo.empty()) {
         throw std::runtime_error("FIFO was not empty at the end of the run!");
     }
 
-    const std::chrono::duration<double> diff = endTS - beginTS;
-
-    const auto perSecond = static_cast<std::size_t>(static_cast<double>(N) / diff.count());
+    return diff;
+}
 
+// Sends N messages one at a time over ping, and waits for each to come back over
+// pong before sending the next, recording the round trips in latency. There is
+// never more than one message in flight, so this is the latency of the queue
+// itself: two cache line transfers each way. Both ends of a round trip are read
+// on the sender's core, so any clock will do. Every message is flushed, as the
+// other side can't answer what it hasn't seen, which leaves a lazy queue with only
+// its lazy acks.
+template<typename T, typename Clock>
+std::chrono::duration<double> benchPingPong(T& ping, T& pong, const std::size_t N, const CpuPair& pair,
+                                            const Clock& clock, LatencyHistogram& latency) {
+    using Ops = QueueOps<T>;
+
+    const auto diff = runPinnedPair(pair, [&ping, &pong, &clock, &latency, N]() {
+        for (std::size_t i = 1; i <= N; i++) {
+            const auto sent = Clock::now();
+            Ops::push(ping, i);
+            Ops::flush(ping);
+            const std::size_t res = Ops::pop(pong);
+            latency.record(elapsedNs(clock, sent));
 
-    // std::cout << "The whole process took: " <<  << std::endl;
-    auto thousands = std::make_unique<separate_thousands>();
-    auto prev = std::cout.imbue(std::locale(std::cout.getloc(), thousands.release()));
-    std::cout << "We sent " << N << " elements in " << std::setprecision(3) << diff << " making it: " << perSecond << " per second" << std::endl;
+            if (res != i) {
+                std::cout << "We expected: " << i << ", but we got " << res << std::endl;
+                throw std::runtime_error("Our two numbers are not as expected!");
+            }
+        }
+        Ops::flushAcks(pong);
+    }, [&ping, &pong, N]() {
+        for (std::size_t i = 1; i <= N; i++) {
+            Ops::push(pong, Ops::pop(ping));
+            Ops::flush(pong);
+        }
+        Ops::flushAcks(ping);
+    });
 
-    std::cout.imbue(prev);
+    // We now assert that the fifos are empty
+    if (!ping.empty() || !pong.empty()) {
+        throw std::runtime_error("FIFO was not empty at the end of the run!");
+    }
 
-    return perSecond;
+    return diff;
 }
 
-template<>
-std::size_t benchWaitSemantics<rigtorp::SPSCQueue<std::size_t>>(rigtorp::SPSCQueue<std::size_t>& fifo, const std::size_t N, const int sendCpu, const int recvCpu) {
-    std::latch all{3};
+// Sends N elements from a forked child process to a thread of ours through a
+// ShmSPSCFifo. The child maps the fifo again from the memfd, so that the two sides
+// have it at different addresses, as they would in unrelated processes. Call this
+// while we have no other threads, so that the child doesn't inherit a held lock.
+std::size_t benchInterProcess(const std::size_t N, const std::size_t capacity, const CpuPair& pair) {
+    ShmSPSCFifo<std::size_t> fifo(capacity);
+
+    // Or the child gets a copy of what we haven't written yet, and writes it again.
+    std::cout.flush();
+    const pid_t pid = fork();
+    if (pid == -1)
+        throw std::runtime_error("fork failed");
+
+    if (pid == 0) {
+        int rc = 0;
+        try {
+            pinThread(pthread_self(), pair.sendCpu);
+            auto child = ShmSPSCFifo<std::size_t>::fromFd(fifo.fd());
+
+            // 0 says that we are up, so that the fork isn't part of the time.
+            for (std::size_t i = 0; i <= N; i++)
+                child.push(i);
+        } catch (const std::exception& e) {
+            std::cerr << "The producer process failed: " << e.what() << std::endl;
+            rc = 1;
+        }
+        _exit(rc);
+    }
 
-    std::thread sender([&all, &fifo, N]() {
-        all.arrive_and_wait();
+    // The producer can die before it has sent everything, and then nothing would ever
+    // wake us in pop. So we only try to pop, and every so often while the fifo is
+    // empty, we look at whether the producer is still there. Once it is gone, we
+    // give it one more round of tries, for what it sent right before exiting.
+    int status = 0;
+    bool reaped = false;
+    const auto pop = [&fifo, &status, &reaped, pid]() {
+        for (std::size_t misses = 0;; misses++) {
+            if (const auto res = fifo.try_pop())
+                return *res;
+
+            if (misses % 1024 != 1023) {
+                detail::cpuRelax();
+                continue;
+            }
 
-        for (std::size_t i = 1; i <= N; i++)
-            fifo.push(i);
+            if (reaped)
+                throw std::runtime_error("The producer process did not exit cleanly");
+            reaped = waitpid(pid, &status, WNOHANG) != 0;
+            std::this_thread::yield();
+        }
+    };
+
+    std::chrono::duration<double> diff{};
+    std::exception_ptr failure;
+    std::thread receiver([&pop, &diff, &failure, N]() {
+        try {
+            if (pop() != 0)
+                throw std::runtime_error("The producer process didn't start with 0!");
+
+            const auto beginTS = std::chrono::steady_clock::now();
+            for (std::size_t i = 1; i <= N; i++) {
+                const auto res = pop();
+                if (res != i) {
+                    std::cout << "We expected: " << i << ", but we got " << res << std::endl;
+                    throw std::runtime_error("Our two numbers are not as expected!");
+                }
+            }
+            diff = std::chrono::steady_clock::now() - beginTS;
+        } catch (...) {
+            failure = std::current_exception();
+        }
     });
+    pinThread(receiver, pair.recvCpu);
+    receiver.join();
 
-    {
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        CPU_SET(sendCpu, &cpuset);
-        const int rc = pthread_setaffinity_np(sender.native_handle(), sizeof(cpu_set_t), &cpuset);
-        if (rc < 0) {
-            std::cerr << "Error calling pthread_setaffinity_np: " << rc << "\n";
-        }
+    if (!reaped) {
+        // It could be stuck pushing to us, if we gave up early.
+        if (failure)
+            kill(pid, SIGKILL);
+        if (waitpid(pid, &status, 0) != pid)
+            throw std::runtime_error("The producer process did not exit cleanly");
     }
 
-    std::thread receiver([&fifo, &all, N]() {
+    if (failure)
+        std::rethrow_exception(failure);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        throw std::runtime_error("The producer process did not exit cleanly");
+
+    // We now assert that the fifo is empty
+    if (!fifo.empty()) {
+        throw std::runtime_error("FIFO was not empty at the end of the run!");
+    }
+
+    return reportRate("elements between processes", N, diff);
+}
+
+// Sends N elements from producers threads into a single consumer. Each element
+// carries the producer in the low byte and its own sequence number above it, so
+// the consumer can check that every producer's elements arrive in order. Producer
+// k is pinned to the k'th of cpus, wrapping around.
+constexpr std::size_t maxProducers = 255;
+
+template<typename T>
+std::size_t benchMultiProducer(T& fifo, const std::size_t N, const std::size_t producers, const int recvCpu, const std::vector<int>& cpus) {
+    if (producers == 0 || maxProducers < producers)
+        throw std::runtime_error("We need between 1 and 255 producers");
+
+    const auto perProducer = N / producers;
+    std::latch all{static_cast<std::ptrdiff_t>(producers + 2)};
+
+    std::vector<std::thread> senders;
+    for (std::size_t p = 0; p < producers; p++) {
+        senders.emplace_back([&all, &fifo, perProducer, p]() {
+            all.arrive_and_wait();
+
+            for (std::size_t i = 1; i <= perProducer; i++)
+                fifo.push((i << 8) | p);
+        });
+        pinThread(senders.back(), cpus[p % cpus.size()]);
+    }
+
+    std::thread receiver([&fifo, &all, perProducer, producers]() {
+        std::vector<std::size_t> last(producers, 0);
         all.arrive_and_wait();
-        std::size_t* res = nullptr;
-        for (std::size_t i = 1; i <= N; i++) {
-            res = fifo.front();
-            while (res == nullptr)
-                res = fifo.front();
 
-            if (*res != i) {
-                std::cout << "We expected: " << i << ", but we got " << *res << std::endl;
+        for (std::size_t i = 0; i < perProducer * producers; i++) {
+            const std::size_t val = fifo.pop();
+            const auto p = val & 0xFF;
+            const auto seq = val >> 8;
+            if (producers <= p || seq != last[p] + 1) {
+                std::cout << "We expected: " << last[p] + 1 << " from producer " << p << ", but we got " << seq << std::endl;
                 throw std::runtime_error("Our two numbers are not as expected!");
             }
-
-            fifo.pop();
+            last[p] = seq;
         }
     });
+    pinThread(receiver, recvCpu);
 
-    {
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        CPU_SET(recvCpu, &cpuset);
-        const int rc = pthread_setaffinity_np(receiver.native_handle(), sizeof(cpu_set_t), &cpuset);
-        if (rc < 0) {
-            std::cerr << "Error calling pthread_setaffinity_np: " << rc << "\n";
-        }
-    }
     const auto beginTS = std::chrono::steady_clock::now();
     all.arrive_and_wait();
-    // std::cout << "We started the sending!" << std::endl;
-    sender.join();
+    for (auto& sender : senders)
+        sender.join();
     receiver.join();
     const auto endTS = std::chrono::steady_clock::now();
 
@@ -262,109 +535,565 @@ std::size_t benchWaitSemantics<rigtorp::SPSCQueue<std::size_t>>(rigtorp::SPSCQue
         throw std::runtime_error("FIFO was not empty at the end of the run!");
     }
 
-    const std::chrono::duration<double> diff = endTS - beginTS;
+    return reportRate("elements from " + std::to_string(producers) + " producers", perProducer * producers, endTS - beginTS);
+}
 
-    const auto perSecond = static_cast<std::size_t>(static_cast<double>(N) / diff.count());
 
+// The fork-join benchmarks, run once on the ThreadPool and once with std::async,
+// which starts a thread for every task it is given.
+
+[[nodiscard]] std::uint64_t fibSerial(const std::uint64_t n) {
+    return n < 2 ? n : fibSerial(n - 1) + fibSerial(n - 2);
+}
+
+[[nodiscard]] std::uint64_t fibPool(ThreadPool& pool, const std::uint64_t n, const std::uint64_t cutoff) {
+    if (n <= cutoff)
+        return fibSerial(n);
+
+    std::uint64_t a = 0;
+    TaskGroup group(pool);
+    group.run([&pool, &a, n, cutoff]() { a = fibPool(pool, n - 1, cutoff); });
+    const auto b = fibPool(pool, n - 2, cutoff);
+    group.wait();
+
+    return a + b;
+}
+
+[[nodiscard]] std::uint64_t fibAsync(const std::uint64_t n, const std::uint64_t cutoff) {
+    if (n <= cutoff)
+        return fibSerial(n);
+
+    auto a = std::async(std::launch::async, fibAsync, n - 1, cutoff);
+    const auto b = fibAsync(n - 2, cutoff);
+
+    return a.get() + b;
+}
+
+// Sums rows [lo, hi) of a.
+[[nodiscard]] double sumRows(const Vector2D<float>& a, const std::size_t lo, const std::size_t hi) {
+    double sum = 0;
+    for (std::size_t r = lo; r < hi; r++)
+        sum += static_cast<double>(detail::reduceLanes(a.row(r).data(), a.columns(), 0.0f, std::plus<>{}));
+    return sum;
+}
+
+[[nodiscard]] double reducePool(ThreadPool& pool, const Vector2D<float>& a, const std::size_t grain) {
+    std::vector<double> partial((a.rows() + grain - 1) / grain);
+    pool.parallel_for(0, a.rows(), grain, [&a, &partial, grain](const std::size_t lo, const std::size_t hi) {
+        partial[lo / grain] = sumRows(a, lo, hi);
+    });
+
+    return std::accumulate(partial.begin(), partial.end(), 0.0);
+}
+
+[[nodiscard]] double reduceAsync(const Vector2D<float>& a, const std::size_t grain) {
+    std::vector<std::future<double>> partial;
+    for (std::size_t lo = 0; lo < a.rows(); lo += grain)
+        partial.push_back(std::async(std::launch::async, sumRows, std::cref(a), lo, std::min(lo + grain, a.rows())));
 
-    // std::cout << "The whole process took: " <<  << std::endl;
-    auto thousands = std::make_unique<separate_thousands>();
-    auto prev = std::cout.imbue(std::locale(std::cout.getloc(), thousands.release()));
-    std::cout << "We sent " << N << " elements in " << std::setprecision(3) << diff << " making it: " << perSecond << " per second" << std::endl;
+    double sum = 0;
+    for (auto& f : partial)
+        sum += f.get();
+    return sum;
+}
 
-    std::cout.imbue(prev);
+template<typename F>
+void timeForkJoin(const std::string& name, const int times, F run) {
+    for (int i = 0; i < times; i++) {
+        const auto beginTS = std::chrono::steady_clock::now();
+        const auto result = run();
+        const auto endTS = std::chrono::steady_clock::now();
 
-    return perSecond;
+        const std::chrono::duration<double> diff = endTS - beginTS;
+        std::cout << name << ": " << std::setprecision(3) << diff << " (result " << result << ")" << std::endl;
+    }
 }
 
+void testForkJoin() {
+    constexpr int times = 3;
+    constexpr std::uint64_t fibN = 40;
+    // The tasks have to be big enough for std::async to survive starting a thread
+    // for each, so we compare at a couple of cutoffs.
+    constexpr std::array<std::uint64_t, 2> cutoffs{28, 24};
+    constexpr std::size_t rows = 8192;
+    constexpr std::size_t grain = 64;
+
+    ThreadPool pool;
+    std::cout << "fork-join on a pool of " << pool.size() << " workers" << std::endl;
+
+    timeForkJoin("fib serial", times, [&]() { return fibSerial(fibN); });
+    for (const auto cutoff : cutoffs) {
+        timeForkJoin("fib pool, cutoff " + std::to_string(cutoff), times, [&]() { return fibPool(pool, fibN, cutoff); });
+        timeForkJoin("fib async, cutoff " + std::to_string(cutoff), times, [&]() { return fibAsync(fibN, cutoff); });
+    }
+
+    Vector2D<float> a(rows, rows);
+    for (std::size_t r = 0; r < rows; r++)
+        for (std::size_t c = 0; c < rows; c++)
+            a.get(r, c) = static_cast<float>((r + c) % 7);
+
+    timeForkJoin("reduce serial", times, [&]() { return sumRows(a, 0, a.rows()); });
+    timeForkJoin("reduce pool", times, [&]() { return reducePool(pool, a, grain); });
+    timeForkJoin("reduce async", times, [&]() { return reduceAsync(a, grain); });
+}
 
 
+// The suites, each an experiment from an earlier change, now on CPU pairs picked
+// from the topology rather than hard-coded.
 
 template<typename T>
-void testFifo(const std::string& name, const std::size_t N) {
+void testBatchFifo(const std::string& name, const std::size_t N, const CpuPair& pair) {
+    T fifo;
+
+    for (const std::size_t batch : {1, 4, 16, 64, 256}) {
+        std::cout << name << ": batch wait semantics: " << pair.kind << ", batch " << batch << std::endl;
+        benchBatchWaitSemantics(fifo, N, batch, pair);
+    }
+}
+
+// Runs the try and wait benchmarks on both the compile-time and the runtime capacity
+// variant of the atomic fifo, interleaved so that they see the same machine state.
+void testCapacityFifo(const std::size_t N, const CpuPair& pair) {
     constexpr int times = 2;
 
-    T fifo;
-    /*
-    std::cout << name << ": try semantics: same core" << std::endl;
+    AtomicSPSCFifo<std::size_t, 512> fixed;
+    AtomicSPSCFifo<std::size_t, std::dynamic_extent> runtime(512);
+
     for (int i = 0; i < times; i++) {
-        benchTrySemantics(fifo, N, 11, 23);
+        std::cout << "atomic compile-time capacity: try semantics: " << pair.kind << std::endl;
+        benchTrySemantics(fixed, N, pair);
+        std::cout << "atomic runtime capacity: try semantics: " << pair.kind << std::endl;
+        benchTrySemantics(runtime, N, pair);
     }
-    std::cout << name << ": try semantics: same l3" << std::endl;
+
     for (int i = 0; i < times; i++) {
-        benchTrySemantics(fifo, N, 22, 23);
+        std::cout << "atomic compile-time capacity: wait semantics: " << pair.kind << std::endl;
+        benchWaitSemantics(fixed, N, pair);
+        std::cout << "atomic runtime capacity: wait semantics: " << pair.kind << std::endl;
+        benchWaitSemantics(runtime, N, pair);
     }
-    std::cout << name << ": try semantics: differnt" << std::endl;
-    for (int i = 0; i < times; i++) {
-        benchTrySemantics(fifo, N, 20, 23);
+}
+
+template<template <typename, std::size_t> typename Fifo, std::size_t Size>
+void testPayloadFifo(const std::string& name, const std::size_t N, const CpuPair& pair) {
+    using P = Payload<Size>;
+    Fifo<P, 512> fifo;
+
+    std::cout << name << ": copy semantics: " << pair.kind << ", " << Size << " byte payload" << std::endl;
+    benchPayloadSemantics<false, P>(fifo, N, pair);
+    std::cout << name << ": zero-copy semantics: " << pair.kind << ", " << Size << " byte payload" << std::endl;
+    benchPayloadSemantics<true, P>(fifo, N, pair);
+}
+
+constexpr std::size_t burstyBursts = 10'000;
+constexpr std::size_t burstySize = 64;
+constexpr std::chrono::microseconds burstyGap{100};
+
+template<typename Wait>
+void testBurstyFifo(const std::string& name, const std::vector<CpuPair>& pairs) {
+    AtomicSPSCFifo<Stamped, 512, std::allocator<Stamped>, Wait> fifo;
+    for (const auto& pair : pairs) {
+        std::cout << name << ": bursty semantics: " << pair.kind << std::endl;
+        benchBurstySemantics(fifo, burstyBursts, burstySize, burstyGap, pair);
     }
-    */
+}
 
-    std::cout << name << ": wait semantics: same core" << std::endl;
-    for (int i = 0; i < times; i++) {
-        benchWaitSemantics(fifo, N, 11, 23);
+// Compares the shared memory fifo between two processes with the same fifo between
+// two threads, and with AtomicSPSCFifo waiting the same way, on each pair.
+void testInterProcessFifo(const std::size_t N, const std::vector<CpuPair>& pairs) {
+    constexpr std::size_t capacity = 512;
+
+    for (const auto& pair : pairs) {
+        AtomicSPSCFifo<std::size_t, capacity, std::allocator<std::size_t>, HybridWait<>> atomic;
+        std::cout << "atomic hybrid: wait semantics: " << pair.kind << std::endl;
+        benchWaitSemantics(atomic, N, pair);
+
+        ShmSPSCFifo<std::size_t> shm(capacity);
+        std::cout << "shm in one process: wait semantics: " << pair.kind << std::endl;
+        benchWaitSemantics(shm, N, pair);
+
+        std::cout << "shm between processes: wait semantics: " << pair.kind << std::endl;
+        benchInterProcess(N, capacity, pair);
     }
-    std::cout << name << ": wait semantics: same l3" << std::endl;
-    for (int i = 0; i < times; i++) {
-        benchWaitSemantics(fifo, N, 22, 23);
+}
+
+// Doubles the number of producers until every other CPU has one, with the
+// consumer on the first CPU.
+template<typename T>
+void testMultiProducerFifo(const std::string& name, const std::size_t N, const CpuTopology& topo) {
+    T fifo;
+
+    std::vector<int> cpus;
+    for (const auto& info : topo.cpus())
+        cpus.push_back(info.cpu);
+
+    const auto recvCpu = cpus.front();
+    if (1 < cpus.size())
+        cpus.erase(cpus.begin());
+
+    // The low byte of an element is all the room there is for the producer.
+    const auto most = std::min(cpus.size(), maxProducers);
+    std::vector<std::size_t> counts;
+    for (std::size_t producers = 1; producers < most; producers *= 2)
+        counts.push_back(producers);
+    counts.push_back(most);
+
+    for (const auto producers : counts) {
+        std::cout << name << ": multi producer wait semantics: " << producers << " producers" << std::endl;
+        benchMultiProducer(fifo, N, producers, recvCpu, cpus);
     }
+}
 
-    std::cout << name << ": wait semantics: differnt" << std::endl;
-    for (int i = 0; i < times; i++) {
-        benchWaitSemantics(fifo, N, 20, 23);
+enum class Mode {
+    Throughput,
+    Latency,
+    PingPong,
+};
+
+struct Options {
+    std::vector<std::string> queues{"atomic"};
+    std::size_t capacity{512};
+    std::size_t payload{8};
+    std::size_t n{10'000'000};
+    std::size_t repeats{5};
+    Semantics semantics{Semantics::Wait};
+    Mode mode{Mode::Throughput};
+    bool tsc{false};
+    std::vector<std::string> pairs;
+    std::string suite;
+};
+
+void printUsage(std::ostream& out) {
+    out << "usage: mthreads [options]\n"
+           "  --queue LIST       comma separated queues out of atomic, lazy8, lazy64,\n"
+           "                     mutex, rigtorp and shm, or all (default atomic). lazyK\n"
+           "                     is atomic publishing every K elements, and shm the\n"
+           "                     shared memory fifo, here within one process\n"
+           "  --capacity N       capacity of the queue (default 512)\n"
+           "  --payload BYTES    8, 64, 256, 1024 or 4096 (default 8), throughput only\n"
+           "  --n N              messages per run (default 10000000)\n"
+           "  --repeats N        runs per CPU pair (default 5)\n"
+           "  --semantics NAME   wait or try (default wait), throughput only\n"
+           "  --mode NAME        throughput, latency (of every message through a busy\n"
+           "                     queue) or pingpong (round trips over two idle queues)\n"
+           "                     (default throughput)\n"
+           "  --clock NAME       steady or tsc, to time the messages with (default steady)\n"
+           "  --pairs LIST       comma separated kinds of CPU pairs to run on, out of\n"
+           "                     smt, l3, cross-l3 and cross-numa (default all we have)\n"
+           "  --suite NAME       run an experiment instead: batch, capacity, payload,\n"
+           "                     bursty, multi-producer, ipc, fork-join or all\n"
+           "  --topology         print the CPU pairs we found and exit\n";
+}
+
+[[nodiscard]] std::size_t parseSize(const std::string_view flag, const std::string_view value) {
+    std::size_t out = 0;
+    // Allow 10'000'000, the way we write them in the code.
+    std::string digits;
+    for (const char c : value)
+        if (c != '\'' && c != '_')
+            digits.push_back(c);
+
+    const auto [ptr, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), out);
+    if (ec != std::errc{} || ptr != digits.data() + digits.size())
+        throw std::runtime_error("expected a number for " + std::string(flag) + ", got: " + std::string(value));
+    return out;
+}
+
+[[nodiscard]] std::vector<std::string> parseList(const std::string& value) {
+    std::vector<std::string> out;
+    std::stringstream ss(value);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        out.push_back(item);
+    return out;
+}
+
+[[nodiscard]] Options parseOptions(const int argc, char** argv) {
+    Options opts;
+    for (int i = 1; i < argc; i++) {
+        const std::string_view flag = argv[i];
+        if (flag == "--help" || flag == "-h") {
+            printUsage(std::cout);
+            std::exit(0);
+        }
+        if (flag == "--topology") {
+            for (const auto& pair : CpuTopology::read().pairs())
+                std::cout << pair.kind << ": " << pair.sendCpu << " -> " << pair.recvCpu << std::endl;
+            std::exit(0);
+        }
+
+        if (i + 1 == argc)
+            throw std::runtime_error("missing a value for " + std::string(flag));
+        const std::string value = argv[++i];
+
+        if (flag == "--queue") {
+            opts.queues = value == "all" ? std::vector<std::string>{"atomic", "lazy8", "lazy64", "mutex", "rigtorp", "shm"} : parseList(value);
+        } else if (flag == "--capacity") {
+            opts.capacity = parseSize(flag, value);
+        } else if (flag == "--payload") {
+            opts.payload = parseSize(flag, value);
+        } else if (flag == "--n") {
+            opts.n = parseSize(flag, value);
+        } else if (flag == "--repeats") {
+            opts.repeats = std::max<std::size_t>(parseSize(flag, value), 1);
+        } else if (flag == "--semantics") {
+            if (value != "wait" && value != "try")
+                throw std::runtime_error("--semantics must be wait or try");
+            opts.semantics = value == "wait" ? Semantics::Wait : Semantics::Try;
+        } else if (flag == "--mode") {
+            if (value == "throughput")
+                opts.mode = Mode::Throughput;
+            else if (value == "latency")
+                opts.mode = Mode::Latency;
+            else if (value == "pingpong")
+                opts.mode = Mode::PingPong;
+            else
+                throw std::runtime_error("--mode must be throughput, latency or pingpong");
+        } else if (flag == "--clock") {
+            if (value != "steady" && value != "tsc")
+                throw std::runtime_error("--clock must be steady or tsc");
+            opts.tsc = value == "tsc";
+        } else if (flag == "--pairs") {
+            opts.pairs = parseList(value);
+        } else if (flag == "--suite") {
+            opts.suite = value;
+        } else {
+            throw std::runtime_error("unknown option: " + std::string(flag));
+        }
     }
+    return opts;
 }
 
+[[nodiscard]] const char* modeName(const Mode mode) {
+    switch (mode) {
+        case Mode::Throughput: return "throughput";
+        case Mode::Latency: return "latency";
+        case Mode::PingPong: return "pingpong";
+    }
+    return "";
+}
 
-void testBestFifo(const std::string& name, const std::size_t N) {
-    constexpr int times = 2;
+// The size of the messages sent, which is only up to the options in throughput mode.
+[[nodiscard]] std::size_t payloadSize(const Options& opts) {
+    switch (opts.mode) {
+        case Mode::Throughput: return opts.payload;
+        case Mode::Latency: return sizeof(Stamped);
+        case Mode::PingPong: return sizeof(std::size_t);
+    }
+    return 0;
+}
 
-    rigtorp::SPSCQueue<std::size_t> fifo(512);
+// Calls f with the Message type for the payload size.
+template<typename F>
+void withMessage(const std::size_t payload, F&& f) {
+    switch (payload) {
+        case 8: f.template operator()<Message<8>>(); break;
+        case 64: f.template operator()<Message<64>>(); break;
+        case 256: f.template operator()<Message<256>>(); break;
+        case 1024: f.template operator()<Message<1024>>(); break;
+        case 4096: f.template operator()<Message<4096>>(); break;
+        default: throw std::runtime_error("unsupported payload size: " + std::to_string(payload));
+    }
+}
 
-    /*
-    std::cout << name << ": try semantics: same core" << std::endl;
-    for (int i = 0; i < times; i++) {
-        benchTrySemantics(fifo, N, 11, 23);
+// Calls f with the type of the queue of M of the given kind. They are all
+// constructed from their capacity.
+template<typename M, typename F>
+void withQueue(const std::string& queue, F&& f) {
+    if (queue == "atomic") {
+        f.template operator()<AtomicSPSCFifo<M, std::dynamic_extent>>();
+    } else if (queue == "lazy8") {
+        f.template operator()<AtomicSPSCFifo<M, std::dynamic_extent, std::allocator<M>, BusySpinWait, 8>>();
+    } else if (queue == "lazy64") {
+        f.template operator()<AtomicSPSCFifo<M, std::dynamic_extent, std::allocator<M>, BusySpinWait, 64>>();
+    } else if (queue == "mutex") {
+        f.template operator()<MutexSPSCFifo<M, std::dynamic_extent>>();
+    } else if (queue == "rigtorp") {
+        f.template operator()<rigtorp::SPSCQueue<M>>();
+    } else if (queue == "shm") {
+        f.template operator()<ShmSPSCFifo<M>>();
+    } else {
+        throw std::runtime_error("unknown queue: " + queue);
     }
-    std::cout << name << ": try semantics: same l3" << std::endl;
-    for (int i = 0; i < times; i++) {
-        benchTrySemantics(fifo, N, 22, 23);
+}
+
+// Calls f with the clock to time messages with.
+template<typename F>
+void withClock(const bool tsc, F&& f) {
+    if (tsc) {
+        // Only built when asked for, as it takes a moment to measure the tick rate.
+        static const TscClock clock;
+        f(clock);
+    } else {
+        f(SteadyClock{});
     }
-    std::cout << name << ": try semantics: differnt" << std::endl;
-    for (int i = 0; i < times; i++) {
-        benchTrySemantics(fifo, N, 20, 23);
+}
+
+// One run of the harness on pair, recording the latencies in latency for the modes
+// that measure them.
+std::chrono::duration<double> runOnce(const Options& opts, const std::string& queue, const CpuPair& pair, LatencyHistogram& latency) {
+    std::chrono::duration<double> diff{};
+
+    switch (opts.mode) {
+        case Mode::Throughput:
+            withMessage(opts.payload, [&]<typename M>() {
+                withQueue<M>(queue, [&]<typename Q>() {
+                    Q fifo(opts.capacity);
+                    diff = opts.semantics == Semantics::Wait
+                            ? benchSemantics<Semantics::Wait, M>(fifo, opts.n, pair)
+                            : benchSemantics<Semantics::Try, M>(fifo, opts.n, pair);
+                });
+            });
+            break;
+
+        case Mode::Latency:
+            withQueue<Stamped>(queue, [&]<typename Q>() {
+                Q fifo(opts.capacity);
+                withClock(opts.tsc, [&](const auto& clock) {
+                    diff = benchLatency(fifo, opts.n, pair, clock, latency);
+                });
+            });
+            break;
+
+        case Mode::PingPong:
+            withQueue<std::size_t>(queue, [&]<typename Q>() {
+                Q ping(opts.capacity);
+                Q pong(opts.capacity);
+                withClock(opts.tsc, [&](const auto& clock) {
+                    diff = benchPingPong(ping, pong, opts.n, pair, clock, latency);
+                });
+            });
+            break;
     }
-    */
 
-    std::cout << name << ": wait semantics: same core" << std::endl;
-    for (int i = 0; i < times; i++) {
-        benchWaitSemantics(fifo, N, 11, 23);
+    return diff;
+}
+
+// The main harness: opts.repeats runs of each queue on each CPU pair, written out
+// as JSON. The progress goes to stderr, so that stdout can be piped straight into
+// a file. In the latency modes, the latencies of all the runs go in one histogram.
+void runHarness(const Options& opts, const std::vector<CpuPair>& pairs) {
+    std::ostringstream results;
+    results << std::setprecision(6);
+
+    bool first = true;
+    for (const auto& queue : opts.queues) {
+        for (const auto& pair : pairs) {
+            std::vector<double> seconds;
+            std::vector<double> rates;
+            LatencyHistogram latency;
+            for (std::size_t r = 0; r < opts.repeats; r++) {
+                const auto diff = runOnce(opts, queue, pair, latency);
+
+                seconds.push_back(diff.count());
+                rates.push_back(static_cast<double>(opts.n) / diff.count());
+                std::cerr << queue << " " << pair.kind << " run " << r + 1 << "/" << opts.repeats
+                          << ": " << diff.count() << "s" << std::endl;
+            }
+
+            results << (first ? "\n" : ",\n")
+                    << "    {\"queue\": \"" << queue << "\", \"pair\": \"" << pair.kind << "\", \"send_cpu\": " << pair.sendCpu
+                    << ", \"recv_cpu\": " << pair.recvCpu << ",\n     \"seconds\": ";
+            writeJson(results, summarize(seconds));
+            results << ",\n     \"ops_per_sec\": ";
+            writeJson(results, summarize(rates));
+            if (opts.mode != Mode::Throughput) {
+                results << ",\n     \"latency_ns\": ";
+                latency.writeJson(results);
+            }
+            results << "}";
+            first = false;
+        }
     }
-    std::cout << name << ": wait semantics: same l3" << std::endl;
-    for (int i = 0; i < times; i++) {
-        benchWaitSemantics(fifo, N, 22, 23);
+
+    std::cout << "{\n"
+              << "  \"mode\": \"" << modeName(opts.mode) << "\",\n"
+              << "  \"clock\": \"" << (opts.tsc ? TscClock::name : SteadyClock::name) << "\",\n"
+              << "  \"capacity\": " << opts.capacity << ",\n"
+              << "  \"payload\": " << payloadSize(opts) << ",\n"
+              << "  \"n\": " << opts.n << ",\n"
+              << "  \"repeats\": " << opts.repeats << ",\n"
+              << "  \"semantics\": \"" << (opts.semantics == Semantics::Wait ? "wait" : "try") << "\",\n"
+              << "  \"results\": [" << results.str() << "\n  ]\n"
+              << "}" << std::endl;
+}
+
+void runSuite(const std::string& suite, const std::size_t N, const CpuTopology& topo) {
+    const auto all = suite == "all";
+    // The suites that only need one pair use two cores sharing an L3, as that is
+    // what we tune for.
+    const auto l3 = topo.pair("l3");
+    // And those comparing near and far use a cross-l3 pair as well, if we have one.
+    std::vector<CpuPair> nearFar{l3};
+    if (const auto far = topo.pair("cross-l3"); far.kind != l3.kind)
+        nearFar.push_back(far);
+
+    if (all || suite == "batch")
+        testBatchFifo<AtomicSPSCFifo<std::size_t, 512>>("atomic", N, l3);
+
+    if (all || suite == "capacity")
+        testCapacityFifo(N, l3);
+
+    if (all || suite == "bursty") {
+        testBurstyFifo<BusySpinWait>("busy spin", nearFar);
+        testBurstyFifo<PauseSpinWait>("pause spin", nearFar);
+        testBurstyFifo<HybridWait<>>("hybrid", nearFar);
+        testBurstyFifo<FutexWait>("futex", nearFar);
+
+        // The old futex pair, which notifies on every operation.
+        AtomicSPSCFifo<Stamped, 512> fifo;
+        std::cout << "futex every op: bursty semantics: " << l3.kind << std::endl;
+        benchBurstySemantics<true>(fifo, burstyBursts, burstySize, burstyGap, l3);
     }
 
-    std::cout << name << ": wait semantics: differnt" << std::endl;
-    for (int i = 0; i < times; i++) {
-        benchWaitSemantics(fifo, N, 20, 23);
+    if (all || suite == "payload") {
+        // The payloads are far bigger, so we send fewer of them.
+        const std::size_t payloadN = N / 20;
+        testPayloadFifo<AtomicSPSCFifo, 256>("atomic", payloadN, l3);
+        testPayloadFifo<AtomicSPSCFifo, 1024>("atomic", payloadN, l3);
+        testPayloadFifo<AtomicSPSCFifo, 4096>("atomic", payloadN, l3);
+        testPayloadFifo<MutexSPSCFifo, 256>("mutex", payloadN, l3);
+        testPayloadFifo<MutexSPSCFifo, 1024>("mutex", payloadN, l3);
+        testPayloadFifo<MutexSPSCFifo, 4096>("mutex", payloadN, l3);
     }
+
+    if (all || suite == "multi-producer") {
+        testMultiProducerFifo<AtomicMPSCFifo<std::size_t, 512>>("mpsc", N, topo);
+        testMultiProducerFifo<AtomicMPMCFifo<std::size_t, 512>>("mpmc", N, topo);
+    }
+
+    if (all || suite == "ipc")
+        testInterProcessFifo(N, nearFar);
+
+    if (all || suite == "fork-join")
+        testForkJoin();
 }
 
-int main(int, char**) {
-    // preFlight<SPSCFifo<std::size_t, 512>();
-    constexpr std::size_t N = 100'000'000;
-    // constexpr std::size_t N = 500'000;
+int main(int argc, char** argv) {
+    // preFlight<AtomicSPSCFifo<std::size_t, 512>>();
+    try {
+        const auto opts = parseOptions(argc, argv);
+        const auto topo = CpuTopology::read();
 
-    std::cout << "The padding on our atomic is: " << AtomicSPSCFifo<std::size_t, 2048>::padding << std::endl;
-    // testMutex(N);
-    // testFifo<MutexSPSCFifo<std::size_t, 512>>("mutex", N);
-    // std::cout << "\n\nSPACE\n\n" << std::endl;
-    testFifo<AtomicSPSCFifo<std::size_t, 512>>("atomic", N);
-    testBestFifo("best", N);
+        if (!opts.suite.empty()) {
+            runSuite(opts.suite, opts.n, topo);
+            return 0;
+        }
 
+        std::vector<CpuPair> pairs;
+        for (const auto& pair : topo.pairs())
+            if (opts.pairs.empty() || std::find(opts.pairs.begin(), opts.pairs.end(), pair.kind) != opts.pairs.end())
+                pairs.push_back(pair);
 
+        if (pairs.empty())
+            throw std::runtime_error("this machine has none of the CPU pairs asked for");
 
+        runHarness(opts, pairs);
+    } catch (const std::exception& e) {
+        std::cerr << "mthreads: " << e.what() << "\n\n";
+        printUsage(std::cerr);
+        return 1;
+    }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,11 +1,17 @@
 #include <benchmark/benchmark.h>
 
+#include "alloc-counters.h"
 #include "sparse-table.h"
+#include "block-rmq.h"
 #include <cinttypes>
 #include <random>
 #include <set>
+#include <utility>
+#include <vector>
 
+template <typename Layout>
 static void BM_rangeMin_query_SparseTable(benchmark::State& state) {
+    const CountAllocations allocations(state);
     const auto maxN = static_cast<std::size_t>(state.range(0));
 
     std::multiset<int> wow;
@@ -15,7 +21,7 @@ static void BM_rangeMin_query_SparseTable(benchmark::State& state) {
     std::uniform_int_distribution<T> vals(1, 10000);
 
     auto f = [](const T a, const T b) { return std::min(a, b); };
-    SparseTable<T, decltype(f), true> st(maxN);
+    SparseTable<T, decltype(f), true, Layout> st(maxN);
 
 
     std::vector<T> cool(maxN);
@@ -39,8 +45,109 @@ static void BM_rangeMin_query_SparseTable(benchmark::State& state) {
 
     state.SetItemsProcessed(state.iterations());
     state.SetComplexityN(state.range(0));
+    state.counters["bytes_per_element"] = static_cast<double>(st.bytes()) / static_cast<double>(maxN);
 }
 
+static void BM_rangeMin_query_BlockRMQ(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+
+    using T = std::int64_t;
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<T> vals(1, 10000);
+
+    BlockRMQ<T> st(maxN);
+
+
+    std::vector<T> cool(maxN);
+    for (std::size_t i = 0; i < maxN; i++)
+        cool[i] = vals(gen);
+
+    st.precompute(cool.begin(), cool.end());
+
+
+    std::uniform_int_distribution<std::size_t> queryDist(0, maxN-1);
+    for (auto _ : state) {
+        // Generate a random question, to prevent optimizer from removing everything.
+        auto l = queryDist(gen);
+        auto r = queryDist(gen);
+        if (r < l)
+            std::swap(r, l);
+
+        T ans = st.query(l, r);
+        benchmark::DoNotOptimize(ans);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetComplexityN(state.range(0));
+    state.counters["bytes_per_element"] = static_cast<double>(st.bytes()) / static_cast<double>(maxN);
+}
+
+template <typename Layout>
+static void BM_rangeMin_queryBatch_SparseTable(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+    const auto batchSize = static_cast<std::size_t>(state.range(1));
+
+    using T = std::int64_t;
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<T> vals(1, 10000);
+
+    auto f = [](const T a, const T b) { return std::min(a, b); };
+    SparseTable<T, decltype(f), true, Layout> st(maxN);
+
+
+    std::vector<T> cool(maxN);
+    for (std::size_t i = 0; i < maxN; i++)
+        cool[i] = vals(gen);
+
+    st.precompute(cool.begin(), cool.end());
+
+    // We generate the questions up front, as generating them is most likely slower
+    // than answering them in a batch.
+    constexpr std::size_t poolSize = 1 << 16;
+    std::vector<std::pair<std::size_t, std::size_t>> queries(poolSize);
+    std::uniform_int_distribution<std::size_t> queryDist(0, maxN-1);
+    for (auto& [l, r] : queries) {
+        l = queryDist(gen);
+        r = queryDist(gen);
+        if (r < l)
+            std::swap(r, l);
+    }
+
+    std::vector<T> answers(batchSize);
+    std::size_t offset = 0;
+    for (auto _ : state) {
+        st.query_batch(std::span(queries).subspan(offset, batchSize), answers);
+        benchmark::DoNotOptimize(answers.data());
+        benchmark::ClobberMemory();
+
+        offset = (offset + batchSize) % poolSize;
+    }
+
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * batchSize));
+    state.SetComplexityN(state.range(0));
+}
+
+
+// The whole point of this one is that it fits where the SparseTable does not.
+BENCHMARK(BM_rangeMin_query_BlockRMQ)->RangeMultiplier(4)->Range(1<<10, 1<<26)->Complexity();
+
+static void queryBatchArgs(benchmark::internal::Benchmark* b) {
+    b->ArgsProduct({
+        benchmark::CreateRange(1<<10, 1<<20, 4),
+        {8, 64, 1024},
+    });
+}
 
+BENCHMARK_TEMPLATE(BM_rangeMin_query_SparseTable, LevelMajorLayout)->RangeMultiplier(2)->Range(1<<10, 1<<20)->Complexity();
+BENCHMARK_TEMPLATE(BM_rangeMin_query_SparseTable, PositionMajorLayout)->RangeMultiplier(2)->Range(1<<10, 1<<20)->Complexity();
+BENCHMARK_TEMPLATE(BM_rangeMin_query_SparseTable, BlockedLayout<8>)->RangeMultiplier(2)->Range(1<<10, 1<<20)->Complexity();
+BENCHMARK_TEMPLATE(BM_rangeMin_query_SparseTable, BlockedLayout<64>)->RangeMultiplier(2)->Range(1<<10, 1<<20)->Complexity();
 
-BENCHMARK(BM_rangeMin_query_SparseTable)->RangeMultiplier(2)->Range(1<<10, 1<<20)->Complexity();
+BENCHMARK_TEMPLATE(BM_rangeMin_queryBatch_SparseTable, LevelMajorLayout)->Apply(queryBatchArgs);
+BENCHMARK_TEMPLATE(BM_rangeMin_queryBatch_SparseTable, PositionMajorLayout)->Apply(queryBatchArgs);
+BENCHMARK_TEMPLATE(BM_rangeMin_queryBatch_SparseTable, BlockedLayout<8>)->Apply(queryBatchArgs);
+BENCHMARK_TEMPLATE(BM_rangeMin_queryBatch_SparseTable, BlockedLayout<64>)->Apply(queryBatchArgs);
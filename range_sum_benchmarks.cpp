@@ -1,7 +1,10 @@
 #include <benchmark/benchmark.h>
 
+#include "alloc-counters.h"
 #include "sparse-table.h"
+#include "segment-tree.h"
 #include <cinttypes>
+#include <functional>
 #include <random>
 
 static void BM_rangeSum_init_PSA(benchmark::State& state) {
@@ -18,6 +21,7 @@ static void BM_rangeSum_init_PSA(benchmark::State& state) {
 
 
     std::uniform_int_distribution<std::size_t> queryDist(1, maxN);
+    const CountAllocations allocations(state, AllocationsPer::Iteration);
     for (auto _ : state) {
         std::vector<T> psa(maxN+1);
         for (std::size_t i = 0; i < maxN; i++) {
@@ -38,6 +42,7 @@ static void BM_rangeSum_init_PSA(benchmark::State& state) {
 }
 
 static void BM_rangeSum_queryAll_PSA(benchmark::State& state) {
+    const CountAllocations allocations(state);
     const auto maxN = static_cast<std::size_t>(state.range(0));
 
     using T = std::int64_t;
@@ -71,6 +76,7 @@ static void BM_rangeSum_queryAll_PSA(benchmark::State& state) {
 }
 
 static void BM_rangeSum_queryCacheMiss_PSA(benchmark::State& state) {
+    const CountAllocations allocations(state);
     const auto maxN = static_cast<std::size_t>(state.range(0));
 
     using T = std::int64_t;
@@ -110,6 +116,7 @@ static void BM_rangeSum_queryCacheMiss_PSA(benchmark::State& state) {
 }
 
 static void BM_rangeSum_querySmall_PSA(benchmark::State& state) {
+    const CountAllocations allocations(state);
     const auto maxN = static_cast<std::size_t>(state.range(0));
 
     using T = std::int64_t;
@@ -146,8 +153,10 @@ static void BM_rangeSum_querySmall_PSA(benchmark::State& state) {
 }
 
 
+template <typename Layout>
 static void BM_rangeSum_init_SparseTable(benchmark::State& state) {
     const auto maxN = static_cast<std::size_t>(state.range(0));
+    const auto threads = static_cast<std::size_t>(state.range(1));
 
     using T = std::int64_t;
 
@@ -163,9 +172,13 @@ static void BM_rangeSum_init_SparseTable(benchmark::State& state) {
 
 
     std::uniform_int_distribution<std::size_t> queryDist(0, maxN-1);
+    const CountAllocations allocations(state, AllocationsPer::Iteration);
     for (auto _ : state) {
-        SparseTable<T, decltype(f), false> st(maxN);
-        st.precompute(cool.begin(), cool.end());
+        SparseTable<T, decltype(f), false, Layout> st(maxN);
+        if (threads == 1)
+            st.precompute(cool.begin(), cool.end());
+        else
+            st.precompute_parallel(cool.begin(), cool.end(), threads);
 
         // Generate a random question, to prevent optimizer from removing everything.
         auto l = queryDist(gen);
@@ -180,7 +193,9 @@ static void BM_rangeSum_init_SparseTable(benchmark::State& state) {
     state.SetItemsProcessed(state.iterations());
 }
 
+template <typename Layout>
 static void BM_rangeSum_queryAll_SparseTable(benchmark::State& state) {
+    const CountAllocations allocations(state);
     const auto maxN = static_cast<std::size_t>(state.range(0));
 
     using T = std::int64_t;
@@ -189,7 +204,7 @@ static void BM_rangeSum_queryAll_SparseTable(benchmark::State& state) {
     std::uniform_int_distribution<T> vals(1, 10000);
 
     auto f = [](const T a, const T b) { return a + b; };
-    SparseTable<T, decltype(f), false> st(maxN);
+    SparseTable<T, decltype(f), false, Layout> st(maxN);
 
 
     std::vector<T> cool(maxN);
@@ -215,7 +230,9 @@ static void BM_rangeSum_queryAll_SparseTable(benchmark::State& state) {
     state.SetComplexityN(state.range(0));
 }
 
+template <typename Layout>
 static void BM_rangeSum_querySmall_SparseTable(benchmark::State& state) {
+    const CountAllocations allocations(state);
     const auto maxN = static_cast<std::size_t>(state.range(0));
 
     using T = std::int64_t;
@@ -224,7 +241,7 @@ static void BM_rangeSum_querySmall_SparseTable(benchmark::State& state) {
     std::uniform_int_distribution<T> vals(1, 10000);
 
     auto f = [](const T a, const T b) { return a + b; };
-    SparseTable<T, decltype(f), false> st(maxN);
+    SparseTable<T, decltype(f), false, Layout> st(maxN);
 
 
     std::vector<T> cool(maxN);
@@ -252,11 +269,428 @@ static void BM_rangeSum_querySmall_SparseTable(benchmark::State& state) {
 }
 
 
+template <typename Layout>
+static void BM_rangeSum_queryCacheMiss_SparseTable(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+
+    using T = std::int64_t;
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<T> vals(1, 10000);
+
+    auto f = [](const T a, const T b) { return a + b; };
+    SparseTable<T, decltype(f), false, Layout> st(maxN);
+
+    std::vector<T> cool(maxN);
+    for (std::size_t i = 0; i < maxN; i++)
+        cool[i] = vals(gen);
+
+    st.precompute(cool.begin(), cool.end());
+
+    // Same access pattern as BM_rangeSum_queryCacheMiss_PSA
+    const auto cacheLine = std::hardware_constructive_interference_size;
+    constexpr auto stride = cacheLine / sizeof(std::int64_t);
+
+    std::uniform_int_distribution<std::size_t> queryDist(1, stride-1);
+    std::uniform_int_distribution<std::size_t> strideDist(1, 10);
+
+    std::size_t cur_idx = 0;
+    for (auto _ : state) {
+        auto l = cur_idx;
+        auto r = l + queryDist(gen);
+        T ans = st.query(l, r);
+        benchmark::DoNotOptimize(ans);
+
+
+        cur_idx = (cur_idx + strideDist(gen)* stride) % (maxN - stride);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_rangeSum_init_DisjointSparseTable(benchmark::State& state) {
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+
+    using T = std::int64_t;
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<T> vals(1, 10000);
+
+    auto f = [](const T a, const T b) { return a + b; };
+
+
+    std::vector<T> cool(maxN);
+    for (std::size_t i = 0; i < maxN; i++)
+        cool[i] = vals(gen);
+
+
+    std::uniform_int_distribution<std::size_t> queryDist(0, maxN-1);
+    const CountAllocations allocations(state, AllocationsPer::Iteration);
+    for (auto _ : state) {
+        DisjointSparseTable<T, decltype(f)> st(maxN);
+        st.precompute(cool.begin(), cool.end());
+
+        // Generate a random question, to prevent optimizer from removing everything.
+        auto l = queryDist(gen);
+        auto r = queryDist(gen);
+        if (r < l)
+            std::swap(r, l);
+
+        T ans = st.query(l, r);
+        benchmark::DoNotOptimize(ans);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_rangeSum_queryAll_DisjointSparseTable(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+
+    using T = std::int64_t;
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<T> vals(1, 10000);
+
+    auto f = [](const T a, const T b) { return a + b; };
+    DisjointSparseTable<T, decltype(f)> st(maxN);
+
+
+    std::vector<T> cool(maxN);
+    for (std::size_t i = 0; i < maxN; i++)
+        cool[i] = vals(gen);
+
+    st.precompute(cool.begin(), cool.end());
+
+
+    std::uniform_int_distribution<std::size_t> queryDist(0, maxN-1);
+    for (auto _ : state) {
+        // Generate a random question, to prevent optimizer from removing everything.
+        auto l = queryDist(gen);
+        auto r = queryDist(gen);
+        if (r < l)
+            std::swap(r, l);
+
+        T ans = st.query(l, r);
+        benchmark::DoNotOptimize(ans);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_rangeSum_querySmall_DisjointSparseTable(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+
+    using T = std::int64_t;
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<T> vals(1, 10000);
+
+    auto f = [](const T a, const T b) { return a + b; };
+    DisjointSparseTable<T, decltype(f)> st(maxN);
+
+
+    std::vector<T> cool(maxN);
+    for (std::size_t i = 0; i < maxN; i++)
+        cool[i] = vals(gen);
+
+    st.precompute(cool.begin(), cool.end());
+
+
+    const auto startRng = std::uniform_int_distribution<std::size_t>(1, maxN-1024)(gen);
+    std::uniform_int_distribution<std::size_t> queryDist(startRng, startRng+1024);
+    for (auto _ : state) {
+        // Generate a random question, to prevent optimizer from removing everything.
+        auto l = queryDist(gen);
+        auto r = queryDist(gen);
+        if (r < l)
+            std::swap(r, l);
+
+        T ans = st.query(l, r);
+        benchmark::DoNotOptimize(ans);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetComplexityN(state.range(0));
+}
+
+
+static void BM_rangeSum_append_PSA(benchmark::State& state) {
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+
+    using T = std::int64_t;
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<T> vals(1, 10000);
+
+    std::vector<T> cool(maxN);
+    for (std::size_t i = 0; i < maxN; i++)
+        cool[i] = vals(gen);
+
+
+    const CountAllocations allocations(state, AllocationsPer::Iteration);
+    for (auto _ : state) {
+        std::vector<T> psa{0};
+        for (const auto x : cool)
+            psa.push_back(psa.back() + x);
+
+        benchmark::DoNotOptimize(psa.data());
+    }
+
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * maxN));
+}
+
+static void BM_rangeSum_update_PSA(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+
+    using T = std::int64_t;
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<T> vals(1, 10000);
+
+    std::vector<T> cool(maxN);
+    for (std::size_t i = 0; i < maxN; i++)
+        cool[i] = vals(gen);
+
+    std::vector<T> psa(maxN+1);
+    for (std::size_t i = 0; i < maxN; i++) {
+        psa[i+1] = psa[i] + cool[i];
+    }
+
+    std::uniform_int_distribution<std::size_t> idxDist(0, maxN-1);
+    for (auto _ : state) {
+        // Every prefix after the point has to be shifted.
+        const auto i = idxDist(gen);
+        const auto val = vals(gen);
+        const auto delta = val - cool[i];
+        cool[i] = val;
+        for (std::size_t j = i+1; j <= maxN; j++)
+            psa[j] += delta;
+
+        benchmark::DoNotOptimize(psa.data());
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_rangeSum_init_SegmentTree(benchmark::State& state) {
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+
+    using T = std::int64_t;
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<T> vals(1, 10000);
+
+    auto f = [](const T a, const T b) { return a + b; };
+
+
+    std::vector<T> cool(maxN);
+    for (std::size_t i = 0; i < maxN; i++)
+        cool[i] = vals(gen);
+
+
+    std::uniform_int_distribution<std::size_t> queryDist(0, maxN-1);
+    const CountAllocations allocations(state, AllocationsPer::Iteration);
+    for (auto _ : state) {
+        SegmentTree<T, decltype(f)> st(f, T{0}, maxN);
+        st.precompute(cool.begin(), cool.end());
+
+        // Generate a random question, to prevent optimizer from removing everything.
+        auto l = queryDist(gen);
+        auto r = queryDist(gen);
+        if (r < l)
+            std::swap(r, l);
+
+        T ans = st.query(l, r);
+        benchmark::DoNotOptimize(ans);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_rangeSum_append_SegmentTree(benchmark::State& state) {
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+
+    using T = std::int64_t;
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<T> vals(1, 10000);
+
+    auto f = [](const T a, const T b) { return a + b; };
+
+    std::vector<T> cool(maxN);
+    for (std::size_t i = 0; i < maxN; i++)
+        cool[i] = vals(gen);
+
+
+    const CountAllocations allocations(state, AllocationsPer::Iteration);
+    for (auto _ : state) {
+        // We start with the smallest tree, to include all the regrowing.
+        SegmentTree<T, decltype(f)> st(f, T{0});
+        for (const auto x : cool)
+            st.push_back(x);
+
+        T ans = st.query(0, maxN-1);
+        benchmark::DoNotOptimize(ans);
+    }
+
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * maxN));
+}
+
+static void BM_rangeSum_update_SegmentTree(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+
+    using T = std::int64_t;
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<T> vals(1, 10000);
+
+    auto f = [](const T a, const T b) { return a + b; };
+    SegmentTree<T, decltype(f)> st(f, T{0}, maxN);
+
+    std::vector<T> cool(maxN);
+    for (std::size_t i = 0; i < maxN; i++)
+        cool[i] = vals(gen);
+
+    st.precompute(cool.begin(), cool.end());
+
+    std::uniform_int_distribution<std::size_t> idxDist(0, maxN-1);
+    for (auto _ : state) {
+        st.update(idxDist(gen), vals(gen));
+    }
+
+    T ans = st.query(0, maxN-1);
+    benchmark::DoNotOptimize(ans);
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_rangeSum_queryAll_SegmentTree(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+
+    using T = std::int64_t;
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<T> vals(1, 10000);
+
+    auto f = [](const T a, const T b) { return a + b; };
+    SegmentTree<T, decltype(f)> st(f, T{0}, maxN);
+
+
+    std::vector<T> cool(maxN);
+    for (std::size_t i = 0; i < maxN; i++)
+        cool[i] = vals(gen);
+
+    st.precompute(cool.begin(), cool.end());
+
+
+    std::uniform_int_distribution<std::size_t> queryDist(0, maxN-1);
+    for (auto _ : state) {
+        // Generate a random question, to prevent optimizer from removing everything.
+        auto l = queryDist(gen);
+        auto r = queryDist(gen);
+        if (r < l)
+            std::swap(r, l);
+
+        T ans = st.query(l, r);
+        benchmark::DoNotOptimize(ans);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_rangeSum_querySmall_SegmentTree(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto maxN = static_cast<std::size_t>(state.range(0));
+
+    using T = std::int64_t;
+
+    std::mt19937 gen(10);
+    std::uniform_int_distribution<T> vals(1, 10000);
+
+    auto f = [](const T a, const T b) { return a + b; };
+    SegmentTree<T, decltype(f)> st(f, T{0}, maxN);
+
+
+    std::vector<T> cool(maxN);
+    for (std::size_t i = 0; i < maxN; i++)
+        cool[i] = vals(gen);
+
+    st.precompute(cool.begin(), cool.end());
+
+
+    const auto startRng = std::uniform_int_distribution<std::size_t>(1, maxN-1024)(gen);
+    std::uniform_int_distribution<std::size_t> queryDist(startRng, startRng+1024);
+    for (auto _ : state) {
+        // Generate a random question, to prevent optimizer from removing everything.
+        auto l = queryDist(gen);
+        auto r = queryDist(gen);
+        if (r < l)
+            std::swap(r, l);
+
+        T ans = st.query(l, r);
+        benchmark::DoNotOptimize(ans);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetComplexityN(state.range(0));
+}
+
+// The table is N*log(N), so 8<<20 is already about 1.5GB. precompute_parallel won't
+// use more threads than there are chunks of parallelMinChunk, so we only register
+// the thread counts that it actually runs with.
+static void initSparseTableArgs(benchmark::internal::Benchmark* b) {
+    constexpr auto minChunk = static_cast<std::int64_t>(SparseTable<std::int64_t, std::plus<>>::parallelMinChunk);
+
+    b->ArgNames({"N", "threads"});
+    for (const auto n : benchmark::CreateRange(8, 8<<20, 8)) {
+        for (const std::int64_t threads : {1, 2, 4, 8}) {
+            if (threads == 1 || threads <= n / minChunk)
+                b->Args({n, threads});
+        }
+    }
+    b->UseRealTime();
+}
+
 BENCHMARK(BM_rangeSum_init_PSA)->Range(8, 8<<12);
-BENCHMARK(BM_rangeSum_init_SparseTable)->Range(8, 8<<12);
+BENCHMARK_TEMPLATE(BM_rangeSum_init_SparseTable, LevelMajorLayout)->Apply(initSparseTableArgs);
+BENCHMARK_TEMPLATE(BM_rangeSum_init_SparseTable, PositionMajorLayout)->Apply(initSparseTableArgs);
+BENCHMARK_TEMPLATE(BM_rangeSum_init_SparseTable, BlockedLayout<8>)->Apply(initSparseTableArgs);
+BENCHMARK_TEMPLATE(BM_rangeSum_init_SparseTable, BlockedLayout<64>)->Apply(initSparseTableArgs);
+BENCHMARK(BM_rangeSum_init_DisjointSparseTable)->Range(8, 8<<12);
+BENCHMARK(BM_rangeSum_init_SegmentTree)->Range(8, 8<<12);
+
+BENCHMARK(BM_rangeSum_append_PSA)->Range(8, 1<<20);
+BENCHMARK(BM_rangeSum_append_SegmentTree)->Range(8, 1<<20);
+BENCHMARK(BM_rangeSum_update_PSA)->RangeMultiplier(4)->Range(1<<10, 1<<20)->Complexity();
+BENCHMARK(BM_rangeSum_update_SegmentTree)->RangeMultiplier(4)->Range(1<<10, 1<<24)->Complexity();
 
 BENCHMARK(BM_rangeSum_queryAll_PSA)->RangeMultiplier(2)->Range(1<<10, 1<<26)->Complexity(); // ->Range(1<<10, 1<<20);
 BENCHMARK(BM_rangeSum_querySmall_PSA)->RangeMultiplier(2)->Range(1<<12, 1<<20)->Complexity(); // ->Range(1<<10, 1<<20);
 BENCHMARK(BM_rangeSum_queryCacheMiss_PSA)->RangeMultiplier(2)->Range(1<<12, 1<<25)->Complexity(); // ->Range(1<<10, 1<<20);
-BENCHMARK(BM_rangeSum_queryAll_SparseTable)->Range(1<<10, 1<<20);
-BENCHMARK(BM_rangeSum_querySmall_SparseTable)->RangeMultiplier(2)->Range(1<<12, 1<<20)->Complexity(); // ->Range(1<<10, 1<<20);
+BENCHMARK_TEMPLATE(BM_rangeSum_queryAll_SparseTable, LevelMajorLayout)->Range(1<<10, 1<<20);
+BENCHMARK_TEMPLATE(BM_rangeSum_queryAll_SparseTable, PositionMajorLayout)->Range(1<<10, 1<<20);
+BENCHMARK_TEMPLATE(BM_rangeSum_queryAll_SparseTable, BlockedLayout<8>)->Range(1<<10, 1<<20);
+BENCHMARK_TEMPLATE(BM_rangeSum_queryAll_SparseTable, BlockedLayout<64>)->Range(1<<10, 1<<20);
+BENCHMARK_TEMPLATE(BM_rangeSum_querySmall_SparseTable, LevelMajorLayout)->RangeMultiplier(2)->Range(1<<12, 1<<20)->Complexity();
+BENCHMARK_TEMPLATE(BM_rangeSum_querySmall_SparseTable, PositionMajorLayout)->RangeMultiplier(2)->Range(1<<12, 1<<20)->Complexity();
+BENCHMARK_TEMPLATE(BM_rangeSum_querySmall_SparseTable, BlockedLayout<8>)->RangeMultiplier(2)->Range(1<<12, 1<<20)->Complexity();
+BENCHMARK_TEMPLATE(BM_rangeSum_querySmall_SparseTable, BlockedLayout<64>)->RangeMultiplier(2)->Range(1<<12, 1<<20)->Complexity();
+BENCHMARK_TEMPLATE(BM_rangeSum_queryCacheMiss_SparseTable, LevelMajorLayout)->RangeMultiplier(2)->Range(1<<12, 1<<22)->Complexity();
+BENCHMARK_TEMPLATE(BM_rangeSum_queryCacheMiss_SparseTable, PositionMajorLayout)->RangeMultiplier(2)->Range(1<<12, 1<<22)->Complexity();
+BENCHMARK_TEMPLATE(BM_rangeSum_queryCacheMiss_SparseTable, BlockedLayout<8>)->RangeMultiplier(2)->Range(1<<12, 1<<22)->Complexity();
+BENCHMARK_TEMPLATE(BM_rangeSum_queryCacheMiss_SparseTable, BlockedLayout<64>)->RangeMultiplier(2)->Range(1<<12, 1<<22)->Complexity();
+BENCHMARK(BM_rangeSum_queryAll_DisjointSparseTable)->Range(1<<10, 1<<20);
+BENCHMARK(BM_rangeSum_querySmall_DisjointSparseTable)->RangeMultiplier(2)->Range(1<<12, 1<<20)->Complexity();
+BENCHMARK(BM_rangeSum_queryAll_SegmentTree)->Range(1<<10, 1<<20);
+BENCHMARK(BM_rangeSum_querySmall_SegmentTree)->RangeMultiplier(2)->Range(1<<12, 1<<20)->Complexity();
@@ -0,0 +1,117 @@
+#pragma once
+
+// A bottom-up segment tree for any associative operation, which unlike the
+// SparseTable can be appended to and updated in place in O(log N).
+//
+// The tree is stored implicitly in a single vector: the root is at 1, the children
+// of node k are at 2k and 2k+1 and the leaves are at [capacity_, 2*capacity_).
+// Every level is then contiguous, and the walks from a leaf to the root or
+// between two leaves need no pointers at all. Leaves we don't have yet hold the
+// identity, so they never change an answer. There is no default for it, as T{} is
+// only the identity of a sum.
+
+#include <algorithm>
+#include <bit>
+#include <iterator>
+#include <stdexcept>
+#include <vector>
+
+template <typename T, typename F>
+class SegmentTree {
+    F func_;
+    T identity_;
+
+    std::size_t size_{0};
+    std::size_t capacity_;
+    std::vector<T> tree_ = std::vector<T>(2*capacity_, identity_);
+
+    void rebuild() {
+        for (std::size_t k = capacity_ - 1; 0 < k; k--)
+            tree_[k] = func_(tree_[2*k], tree_[2*k + 1]);
+    }
+
+    void grow(std::size_t minCapacity) {
+        const auto newCapacity = std::bit_ceil(minCapacity);
+        std::vector<T> next(2*newCapacity, identity_);
+        std::copy(tree_.begin() + static_cast<std::ptrdiff_t>(capacity_),
+                  tree_.begin() + static_cast<std::ptrdiff_t>(capacity_ + size_),
+                  next.begin() + static_cast<std::ptrdiff_t>(newCapacity));
+
+        tree_ = std::move(next);
+        capacity_ = newCapacity;
+        rebuild();
+    }
+
+    // Recomputes all the parents of leaf i.
+    void fixUp(std::size_t i) {
+        for (auto k = (i + capacity_) / 2; 0 < k; k /= 2)
+            tree_[k] = func_(tree_[2*k], tree_[2*k + 1]);
+    }
+
+public:
+
+    SegmentTree(F fn, T identity, std::size_t capacity = 1)
+        : func_{fn}, identity_{identity}, capacity_{std::bit_ceil(std::max<std::size_t>(capacity, 1))} {}
+
+    [[nodiscard]] std::size_t size() const {
+        return size_;
+    }
+
+    [[nodiscard]] std::size_t capacity() const {
+        return capacity_;
+    }
+
+    // Replaces the contents with [first, last), building the tree in O(N).
+    template <typename IT>
+    void precompute(IT first, IT last) {
+        const auto n = static_cast<std::size_t>(std::distance(first, last));
+        size_ = 0;
+        if (capacity_ < n) {
+            grow(n);
+        } else {
+            std::fill(tree_.begin(), tree_.end(), identity_);
+        }
+
+        std::copy(first, last, tree_.begin() + static_cast<std::ptrdiff_t>(capacity_));
+        size_ = n;
+        rebuild();
+    }
+
+    void push_back(const T& value) {
+        // Doubling keeps the rebuilds down to amortized O(1) per append.
+        if (size_ == capacity_)
+            grow(2*capacity_);
+
+        tree_[capacity_ + size_] = value;
+        fixUp(size_);
+        size_++;
+    }
+
+    void update(std::size_t i, const T& value) {
+        if (size_ <= i)
+            throw std::out_of_range("update index is past the end of the tree");
+
+        tree_[capacity_ + i] = value;
+        fixUp(i);
+    }
+
+    [[nodiscard]] T query(std::size_t l, std::size_t r) const {
+        // we assume that l <= r < size(). We keep the left and right part apart, so
+        // that we never need the operation to be commutative.
+        T left = identity_;
+        T right = identity_;
+        for (l += capacity_, r += capacity_ + 1; l < r; l /= 2, r /= 2) {
+            if (l & 1)
+                left = func_(left, tree_[l++]);
+            if (r & 1)
+                right = func_(tree_[--r], right);
+        }
+
+        return func_(left, right);
+    }
+
+    // The number of bytes used for the tree itself.
+    [[nodiscard]] std::size_t bytes() const {
+        return tree_.size() * sizeof(T);
+    }
+};
@@ -2,74 +2,384 @@
 
 #include "vector2d.h"
 
+#include <algorithm>
+#include <array>
+#include <barrier>
 #include <bit>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <span>
 #include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
-template <typename T, typename F, bool IDEMPOTENT = false>
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// The layouts decide where the entry for (level, position) of a SparseTable lives
+// in the underlying Vector2D. The fileTag identifies the layout in index files.
+
+// Every level is its own row. Building is a sequential sweep, but the two halves
+// of a query are in rows that can be megabytes apart.
+struct LevelMajorLayout {
+    static constexpr std::uint64_t fileTag = 1;
+
+    std::size_t levels;
+    std::size_t positions;
+
+    [[nodiscard]] constexpr std::size_t rows() const { return levels; }
+    [[nodiscard]] constexpr std::size_t columns() const { return positions; }
+    [[nodiscard]] constexpr std::size_t row(std::size_t level, std::size_t) const { return level; }
+    [[nodiscard]] constexpr std::size_t column(std::size_t, std::size_t pos) const { return pos; }
+};
+
+// All the levels for a position are next to each other. Building touches two
+// short rows per entry, and a query can only miss on the positions, not the levels.
+struct PositionMajorLayout {
+    static constexpr std::uint64_t fileTag = 2;
+
+    std::size_t levels;
+    std::size_t positions;
+
+    [[nodiscard]] constexpr std::size_t rows() const { return positions; }
+    [[nodiscard]] constexpr std::size_t columns() const { return levels; }
+    [[nodiscard]] constexpr std::size_t row(std::size_t, std::size_t pos) const { return pos; }
+    [[nodiscard]] constexpr std::size_t column(std::size_t level, std::size_t) const { return level; }
+};
+
+// The positions are split into tiles of BlockSize, and each tile stores all its
+// levels level-major. A row is then a tile, which keeps a tile's levels within a
+// few pages while the building still sweeps BlockSize elements at a time.
+template <std::size_t BlockSize>
+struct BlockedLayout {
+    static_assert(0 < BlockSize, "The block size must be positive");
+
+    static constexpr std::uint64_t fileTag = 3 | (BlockSize << 8);
+
+    std::size_t levels;
+    std::size_t positions;
+
+    [[nodiscard]] constexpr std::size_t rows() const { return (positions + BlockSize - 1) / BlockSize; }
+    [[nodiscard]] constexpr std::size_t columns() const { return levels * BlockSize; }
+    [[nodiscard]] constexpr std::size_t row(std::size_t, std::size_t pos) const { return pos / BlockSize; }
+    [[nodiscard]] constexpr std::size_t column(std::size_t level, std::size_t pos) const {
+        return level * BlockSize + pos % BlockSize;
+    }
+};
+
+// The query for a sparse table, shared by SparseTable and the views of tables stored
+// elsewhere. at(i, j) has to give the entry covering [j, j + 2^i - 1].
+template <bool IDEMPOTENT, typename T, typename F, typename At>
+[[nodiscard]] T sparseTableQuery(const F& func, const std::size_t maxK, const At& at, std::size_t l, const std::size_t r) {
+    // we assume that l < r
+    if constexpr (IDEMPOTENT) {
+        // as this operation is idempotent, there is no need to carefully
+        // select the items, we just pick the two ranges that might overlap,
+        // but which cover the whole array
+        auto i = static_cast<std::size_t>(std::bit_width(r-l+1) - 1);
+        return func(at(i, l), at(i, r- (static_cast<std::size_t>(1) << i) + 1));
+    } else {
+        std::size_t i = maxK+1;
+        // We need the first hit here.
+        for (; 0 < i; i--) {
+            const auto ii = i-1;
+            // If we can fit the size.
+            if ((static_cast<std::size_t>(1) << ii) <= r - l + 1) {
+                break;
+            }
+        }
+
+        if (i == 0)
+            throw std::runtime_error("we couldn't find a query range?");
+
+        T ans = at(i-1, l);
+        l += (1 << (i-1));
+
+        // decrement ones, as we have already done this.
+        i--;
+        // Now we repeat the pattern, for the rest.
+        for (; 0 < i; i--) {
+            const auto ii = i-1;
+            if ((static_cast<std::size_t>(1) << ii) <= r - l + 1) {
+                ans = func(ans, at(ii, l));
+                l += (1 << ii);
+            }
+        }
+
+        return ans;
+    }
+}
+
+// The table is allocated with Alloc, so that with a std::pmr or mi_heap allocator the
+// tables of a whole query session can live in an arena, and be dropped at once.
+template <typename T, typename F, bool IDEMPOTENT = false, typename Layout = LevelMajorLayout,
+          typename Alloc = std::allocator<T>>
 class SparseTable {
     F func_{};
     const std::size_t maxN_;
     const std::size_t maxK_{static_cast<std::size_t>(std::bit_width(maxN_)-1)};
 
-    Vector2D<T> data_{maxK_+1, maxN_+1};
+    const Layout layout_{maxK_+1, maxN_+1};
+    Vector2D<T, Alloc> data_;
 
-public:
+    [[nodiscard]] std::size_t idx(std::size_t level, std::size_t pos) const {
+        return data_.idx(layout_.row(level, pos), layout_.column(level, pos));
+    }
 
-    explicit SparseTable(std::size_t maxN) : maxN_{maxN} {}
-    SparseTable(F fn, std::size_t maxN) : func_{fn},  maxN_{maxN} {}
+    [[nodiscard]] const T& at(std::size_t level, std::size_t pos) const {
+        return data_.data()[idx(level, pos)];
+    }
 
-    template <typename IT>
-    void precompute(IT first, IT last) {
-        // This is a bit dirty, but we know the internals of the 2D data.
-        std::copy(first, last, data_.data());
+    [[nodiscard]] T& at(std::size_t level, std::size_t pos) {
+        return data_.data()[idx(level, pos)];
+    }
+
+    // The number of entries in level i.
+    [[nodiscard]] std::size_t levelLength(std::size_t i) const {
+        const auto width = static_cast<std::size_t>(1) << i;
+        return width <= maxN_ ? maxN_ - width + 1 : 0;
+    }
 
-        for (std::size_t i = 1; i <= maxK_; i++) {
-            for (std::size_t j = 0; j + (1 << i) <= maxN_; j++) {
-                data_.get(i, j) = func_(
-                        data_.get(i-1, j), // range [j, j + 2^(i-1) -1]
-                        data_.get(i-1, j + (1 << (i -1))) // range [j + 2^(i-1), j + 2^i - 1]
+    // Computes the entries [jBegin, jEnd) of level i from level i-1.
+    void buildLevel(const std::size_t i, const std::size_t jBegin, const std::size_t jEnd) {
+        const auto half = static_cast<std::size_t>(1) << (i-1);
+        if constexpr (std::is_same_v<Layout, LevelMajorLayout>) {
+            // Both levels are contiguous here, so we work on raw rows, which
+            // lets the compiler vectorize the loop.
+            T* dst = &at(i, 0);
+            const T* src = &at(i-1, 0);
+            for (std::size_t j = jBegin; j < jEnd; j++)
+                dst[j] = func_(src[j], src[j + half]);
+        } else {
+            for (std::size_t j = jBegin; j < jEnd; j++) {
+                at(i, j) = func_(
+                        at(i-1, j), // range [j, j + 2^(i-1) -1]
+                        at(i-1, j + half) // range [j + 2^(i-1), j + 2^i - 1]
                 );
             }
         }
     }
 
-    [[nodiscard]] T query(std::size_t l, const std::size_t r) const {
-        // we assume that l < r
-        if constexpr (IDEMPOTENT) {
-            // as this operation is idempotent, there is no need to carefully
-            // select the items, we just pick the two ranges that might overlap,
-            // but which cover the whole array
-            auto i = static_cast<std::size_t>(std::bit_width(r-l+1) - 1);
-            return func_(data_.get(i, l), data_.get(i, r- (static_cast<std::size_t>(1) << i) + 1));
+    // The number of queries we resolve per gather round in query_batch.
+    static constexpr std::size_t batchWidth = 8;
+
+    // We can only gather raw lanes of 4 or 8 bytes, and we need to be allowed
+    // to treat them as bits.
+    static constexpr bool gatherable = IDEMPOTENT && std::is_trivially_copyable_v<T> &&
+            (sizeof(T) == 4 || sizeof(T) == 8);
+
+    // Gathers the elements at the flat indexes in idx into dst.
+    static void gather(const T* base, const std::array<std::int64_t, batchWidth>& idx,
+                       std::array<T, batchWidth>& dst) {
+#if defined(__AVX512F__)
+        // We use the masked gathers with a zeroed source, as GCC warns about the
+        // uninitialized source in the unmasked ones.
+        const __m512i vidx = _mm512_loadu_si512(idx.data());
+        if constexpr (sizeof(T) == 8) {
+            _mm512_storeu_si512(dst.data(), _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), 0xFF, vidx, base, 8));
         } else {
-            std::size_t i = maxK_+1;
-            // We need the first hit here.
-            for (; 0 < i; i--) {
-                const auto ii = i-1;
-                // If we can fit the size.
-                if ((static_cast<std::size_t>(1) << ii) <= r - l + 1) {
-                    break;
-                }
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst.data()),
+                                _mm512_mask_i64gather_epi32(_mm256_setzero_si256(), 0xFF, vidx, base, 4));
+        }
+#elif defined(__AVX2__)
+        const auto* lanes = reinterpret_cast<const long long*>(idx.data());
+        for (std::size_t h = 0; h < batchWidth; h += 4) {
+            const __m256i vidx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lanes + h));
+            if constexpr (sizeof(T) == 8) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst.data() + h),
+                                    _mm256_i64gather_epi64(reinterpret_cast<const long long*>(base), vidx, 8));
+            } else {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst.data() + h),
+                                 _mm256_i64gather_epi32(reinterpret_cast<const int*>(base), vidx, 4));
             }
+        }
+#else
+        for (std::size_t h = 0; h < batchWidth; h++)
+            dst[h] = base[idx[h]];
+#endif
+    }
+
+public:
+    using allocator_type = Alloc;
+
+    // precompute_parallel gives every thread at least this many positions, as there
+    // is no point in waking up a thread for less.
+    static constexpr std::size_t parallelMinChunk = 1 << 14;
+
+    explicit SparseTable(std::size_t maxN, const Alloc& alloc = Alloc{})
+        : maxN_{maxN}, data_{layout_.rows(), layout_.columns(), alloc} {}
+    SparseTable(F fn, std::size_t maxN, const Alloc& alloc = Alloc{})
+        : func_{fn},  maxN_{maxN}, data_{layout_.rows(), layout_.columns(), alloc} {}
 
-            if (i == 0)
-                throw std::runtime_error("we couldn't find a query range?");
+    [[nodiscard]] allocator_type get_allocator() const noexcept {
+        return data_.get_allocator();
+    }
 
-            T ans = data_.get(i-1, l);
-            l += (1 << (i-1));
+    template <typename IT>
+    void precompute(IT first, IT last) {
+        for (std::size_t j = 0; first != last; ++first, ++j)
+            at(0, j) = *first;
 
-            // decrement ones, as we have already done this.
-            i--;
-            // Now we repeat the pattern, for the rest.
-            for (; 0 < i; i--) {
-                const auto ii = i-1;
-                if ((static_cast<std::size_t>(1) << ii) <= r - l + 1) {
-                    ans = func_(ans, data_.get(ii, l));
-                    l += (1 << ii);
+        for (std::size_t i = 1; i <= maxK_; i++)
+            buildLevel(i, 0, levelLength(i));
+    }
+
+    // Same as precompute, but every level is split into chunks across threads,
+    // with a barrier between the levels, as each level only depends on the one
+    // before it. A threads of 0 means one per hardware thread. We never use more
+    // than maxN / parallelMinChunk threads, so small tables are built by one.
+    template <std::random_access_iterator IT>
+    void precompute_parallel(IT first, IT last, std::size_t threads = 0) {
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+
+        threads = std::clamp<std::size_t>(maxN_ / parallelMinChunk, 1, threads);
+
+        const auto n = static_cast<std::size_t>(last - first);
+        std::barrier sync(static_cast<std::ptrdiff_t>(threads));
+
+        auto worker = [&](const std::size_t t) {
+            for (std::size_t j = t * n / threads; j < (t+1) * n / threads; j++)
+                at(0, j) = first[static_cast<std::iter_difference_t<IT>>(j)];
+
+            for (std::size_t i = 1; i <= maxK_; i++) {
+                sync.arrive_and_wait();
+
+                const auto len = levelLength(i);
+                buildLevel(i, t * len / threads, (t+1) * len / threads);
+            }
+        };
+
+        std::vector<std::thread> pool;
+        pool.reserve(threads - 1);
+        for (std::size_t t = 1; t < threads; t++)
+            pool.emplace_back(worker, t);
+
+        worker(0);
+
+        for (auto& th : pool)
+            th.join();
+    }
+
+    [[nodiscard]] T query(std::size_t l, const std::size_t r) const {
+        return sparseTableQuery<IDEMPOTENT, T>(func_, maxK_, [this](std::size_t i, std::size_t j) -> const T& {
+            return at(i, j);
+        }, l, r);
+    }
+
+    // The raw storage, in the order given by the layout.
+    [[nodiscard]] std::span<const T> raw() const {
+        return {data_.data(), data_.size()};
+    }
+
+    [[nodiscard]] std::size_t maxN() const {
+        return maxN_;
+    }
+
+    // The number of bytes used for the table itself.
+    [[nodiscard]] std::size_t bytes() const {
+        return data_.size() * sizeof(T);
+    }
+
+    // Answers queries[q] into out[q]. For idempotent operations we resolve the
+    // queries batchWidth at a time, gathering both halves of every query in one go,
+    // rather than doing two dependent scattered loads per call.
+    void query_batch(std::span<const std::pair<std::size_t, std::size_t>> queries, std::span<T> out) const {
+        if (out.size() < queries.size())
+            throw std::runtime_error("the output span is smaller than the number of queries");
+
+        std::size_t q = 0;
+        if constexpr (gatherable) {
+            const T* base = data_.data();
+            std::array<std::int64_t, batchWidth> loIdx{};
+            std::array<std::int64_t, batchWidth> hiIdx{};
+            std::array<T, batchWidth> lo{};
+            std::array<T, batchWidth> hi{};
+
+            for (; q + batchWidth <= queries.size(); q += batchWidth) {
+                for (std::size_t h = 0; h < batchWidth; h++) {
+                    const auto [l, r] = queries[q + h];
+                    const auto i = static_cast<std::size_t>(std::bit_width(r-l+1) - 1);
+                    loIdx[h] = static_cast<std::int64_t>(idx(i, l));
+                    hiIdx[h] = static_cast<std::int64_t>(idx(i, r - (static_cast<std::size_t>(1) << i) + 1));
                 }
+
+                gather(base, loIdx, lo);
+                gather(base, hiIdx, hi);
+
+                for (std::size_t h = 0; h < batchWidth; h++)
+                    out[q + h] = func_(lo[h], hi[h]);
             }
+        }
+
+        // The tail, or everything if we can't gather.
+        for (; q < queries.size(); q++)
+            out[q] = query(queries[q].first, queries[q].second);
+    }
+};
+
+// A disjoint sparse table answers any associative operation with two lookups and
+// a single combine, at the cost of the same N*log(N) memory as the SparseTable.
+// For every level h the array is cut into blocks of size 2^(h+1), and for each block
+// we store the suffix combines of the left half and the prefix combines of the
+// right half, both running outwards from the middle.
+template <typename T, typename F, typename Alloc = std::allocator<T>>
+class DisjointSparseTable {
+    F func_{};
+    const std::size_t maxN_;
+    // The number of levels needed, so that any l < r differ in a bit below it.
+    const std::size_t levels_{maxN_ < 2 ? 0 : static_cast<std::size_t>(std::bit_width(maxN_-1))};
+
+    // Row 0 is the input itself, row h+1 is level h.
+    Vector2D<T, Alloc> data_;
+
+public:
+    using allocator_type = Alloc;
+
+    explicit DisjointSparseTable(std::size_t maxN, const Alloc& alloc = Alloc{})
+        : maxN_{maxN}, data_{levels_+1, maxN_, alloc} {}
+    DisjointSparseTable(F fn, std::size_t maxN, const Alloc& alloc = Alloc{})
+        : func_{fn},  maxN_{maxN}, data_{levels_+1, maxN_, alloc} {}
 
-            return ans;
+    [[nodiscard]] allocator_type get_allocator() const noexcept {
+        return data_.get_allocator();
+    }
+
+    template <typename IT>
+    void precompute(IT first, IT last) {
+        std::copy(first, last, data_.data());
+
+        for (std::size_t h = 0; h < levels_; h++) {
+            const std::size_t half = static_cast<std::size_t>(1) << h;
+            // Anything with the middle at or after maxN_ can't ever be queried, as
+            // the right end would be out of bounds.
+            for (std::size_t mid = half; mid < maxN_; mid += 2*half) {
+                // left half, running from mid-1 down to mid-half
+                data_.get(h+1, mid-1) = data_.get(0, mid-1);
+                for (std::size_t i = mid-1; mid-half < i; i--)
+                    data_.get(h+1, i-1) = func_(data_.get(0, i-1), data_.get(h+1, i));
+
+                // right half, running from mid up to mid+half-1
+                const std::size_t end = std::min(mid + half, maxN_);
+                data_.get(h+1, mid) = data_.get(0, mid);
+                for (std::size_t i = mid+1; i < end; i++)
+                    data_.get(h+1, i) = func_(data_.get(h+1, i-1), data_.get(0, i));
+            }
         }
     }
+
+    [[nodiscard]] T query(std::size_t l, const std::size_t r) const {
+        // we assume that l <= r
+        if (l == r)
+            return data_.get(0, l);
+
+        // The highest differing bit tells us the level where l and r are in the same
+        // block, but on opposite sides of the middle.
+        const auto h = static_cast<std::size_t>(std::bit_width(l ^ r) - 1);
+        return func_(data_.get(h+1, l), data_.get(h+1, r));
+    }
 };
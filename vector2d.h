@@ -2,30 +2,57 @@
 
 // This is a generic 2D vector, in a single vector. It will be removed once we get
 // std::mdspan in c++23
+//
+// The rows can be padded, so that a row starts every stride() elements rather than
+// every columns(). See paddedStride for why you would want that.
+//
+// It is allocator aware like the standard containers, so with a std::pmr or a
+// mi_heap allocator it can live in an arena along with everything around it.
 
+#include "view2d.h"
+
+#include <memory>
+#include <span>
 #include <vector>
 
-template <typename T>
+template <typename T, typename Alloc = std::allocator<T>>
 class Vector2D {
 private:
     std::size_t rows_{0};
     std::size_t cols_{0};
-    std::vector<T> data_;
+    std::size_t stride_{0};
+    std::vector<T, Alloc> data_;
 
 public:
+    using allocator_type = Alloc;
+
+    Vector2D(std::size_t rows, std::size_t cols, const Alloc& alloc = Alloc{}) : Vector2D(rows, cols, cols, alloc) {}
 
-    Vector2D(std::size_t rows, std::size_t cols) : rows_{rows}, cols_{cols}, data_(rows_*cols_) {}
+    Vector2D(std::size_t rows, std::size_t cols, std::size_t stride, const Alloc& alloc = Alloc{})
+        : rows_{rows}, cols_{cols}, stride_{stride}, data_(rows_*stride_, alloc) {}
 
     Vector2D(const Vector2D& other) :
-            rows_{other.rows_} , cols_{other.cols_}
+            rows_{other.rows_} , cols_{other.cols_}, stride_{other.stride_}
             , data_{other.data_}
     {}
 
     Vector2D(Vector2D&& other) noexcept :
-            rows_{other.rows_} , cols_{other.cols_}
+            rows_{other.rows_} , cols_{other.cols_}, stride_{other.stride_}
             , data_{std::move(other.data_)}
     {}
 
+    // The copy and move into another allocator, which is what uses-allocator
+    // construction calls, when a Vector2D is put in a container with a pmr allocator.
+    Vector2D(const Vector2D& other, const Alloc& alloc) :
+            rows_{other.rows_} , cols_{other.cols_}, stride_{other.stride_}
+            , data_(other.data_, alloc)
+    {}
+
+    Vector2D(Vector2D&& other, const Alloc& alloc) :
+            rows_{other.rows_} , cols_{other.cols_}, stride_{other.stride_}
+            , data_(std::move(other.data_), alloc)
+    {}
+
     Vector2D& operator=(const Vector2D& other) {
         *this = Vector2D(other);
         return *this;
@@ -34,10 +61,32 @@ public:
     Vector2D& operator=(Vector2D&& other) noexcept {
         rows_ = other.rows_;
         cols_ = other.cols_;
+        stride_ = other.stride_;
         data_ = std::move(other.data_);
         return *this;
     }
 
+    // A row stride for cols columns that avoids cache set aliasing. When rows are a
+    // multiple of a large power of two apart, walking down a column keeps hitting
+    // the same few cache sets. We round the row up to whole cache lines, and then
+    // make the number of lines odd, so consecutive rows spread over all the sets.
+    [[nodiscard]] static constexpr std::size_t paddedStride(std::size_t cols) {
+        constexpr std::size_t cacheLine = 64;
+        if (cacheLine % sizeof(T) != 0)
+            return cols;
+
+        constexpr std::size_t perLine = cacheLine / sizeof(T);
+        auto lines = (cols + perLine - 1) / perLine;
+        if (lines % 2 == 0)
+            lines++;
+
+        return lines * perLine;
+    }
+
+    [[nodiscard]] allocator_type get_allocator() const noexcept {
+        return data_.get_allocator();
+    }
+
     [[nodiscard]] std::size_t rows() const {
         return rows_;
     }
@@ -46,8 +95,17 @@ public:
         return cols_;
     }
 
+    [[nodiscard]] std::size_t stride() const {
+        return stride_;
+    }
+
+    // The number of elements in the underlying storage, including the padding.
+    [[nodiscard]] std::size_t size() const {
+        return data_.size();
+    }
+
     [[nodiscard]] std::size_t idx(std::size_t row, std::size_t col) const {
-        return row*cols_ + col;
+        return row*stride_ + col;
     }
 
     [[nodiscard]] const T& get(std::size_t row, std::size_t col) const {
@@ -65,4 +123,37 @@ public:
     [[nodiscard]] const T* data() const {
         return data_.data();
     }
-};
\ No newline at end of file
+
+    [[nodiscard]] std::span<T> row(std::size_t row) {
+        return {data_.data() + idx(row, 0), cols_};
+    }
+
+    [[nodiscard]] std::span<const T> row(std::size_t row) const {
+        return {data_.data() + idx(row, 0), cols_};
+    }
+
+    [[nodiscard]] StridedSpan<T> column(std::size_t col) {
+        return {data_.data() + idx(0, col), rows_, stride_};
+    }
+
+    [[nodiscard]] StridedSpan<const T> column(std::size_t col) const {
+        return {data_.data() + idx(0, col), rows_, stride_};
+    }
+
+    [[nodiscard]] View2D<T> view() {
+        return {data_.data(), LayoutRight{rows_, cols_, stride_}};
+    }
+
+    [[nodiscard]] View2D<const T> view() const {
+        return {data_.data(), LayoutRight{rows_, cols_, stride_}};
+    }
+
+    // The rows x cols sub matrix, starting at (row, col).
+    [[nodiscard]] View2D<T> tile(std::size_t row, std::size_t col, std::size_t rows, std::size_t cols) {
+        return view().tile(row, col, rows, cols);
+    }
+
+    [[nodiscard]] View2D<const T> tile(std::size_t row, std::size_t col, std::size_t rows, std::size_t cols) const {
+        return view().tile(row, col, rows, cols);
+    }
+};
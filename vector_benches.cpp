@@ -1,12 +1,17 @@
+#include <algorithm>
 #include <iostream>
 #include <random>
 #include <benchmark/benchmark.h>
 #include <vector>
 
+#include "alloc-counters.h"
+#include "allocators.h"
+#include "matrix-kernels.h"
 #include "vector2d.h"
 
 
 static void BM_plainVector_readAllSeq(benchmark::State& state) {
+    const CountAllocations allocations(state);
     std::vector<std::vector<float>> mdim(state.range(0));
     for (auto& dim : mdim)
         dim.resize(state.range(1));
@@ -31,6 +36,7 @@ static void BM_plainVector_readAllSeq(benchmark::State& state) {
 }
 
 static void BM_plainVector_readRandom(benchmark::State& state) {
+    const CountAllocations allocations(state);
     std::vector<std::vector<float>> mdim(state.range(0));
     for (auto& dim : mdim)
         dim.resize(state.range(1));
@@ -57,6 +63,7 @@ static void BM_plainVector_readRandom(benchmark::State& state) {
 }
 
 static void BM_2dvec_readAllSeq(benchmark::State& state) {
+    const CountAllocations allocations(state);
     Vector2D<float> mdim(state.range(0), state.range(1));
 
     // Fixed seed
@@ -80,9 +87,306 @@ static void BM_2dvec_readAllSeq(benchmark::State& state) {
     state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * mdim.rows() * mdim.columns()));
 }
 
-static void BM_2dvec_readRandom(benchmark::State& state) {
+static void BM_2dvec_readAllRows(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    Vector2D<float> mdim(state.range(0), state.range(1));
+
+    // Fixed seed
+    std::mt19937 gen(10);
+    std::uniform_real_distribution<float> dis(0.0, 1.0);
+    for (std::size_t row = 0; row < mdim.rows(); row++) {
+        for (auto& x : mdim.row(row))
+            x = dis(gen);
+    }
+
+
+    for (auto _ : state) {
+        for (std::size_t row = 0; row < mdim.rows(); row++) {
+            float x = 0;
+            for (const auto elem : mdim.row(row))
+                benchmark::DoNotOptimize(x = elem);
+        }
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * mdim.rows() * mdim.columns()));
+}
+
+// Walks down the columns. With Padded the rows are paddedStride apart, rather
+// than a power of 2 floats, which keeps the column from aliasing in the cache.
+template <bool Padded>
+static void BM_2dvec_readAllColumnMajor(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto rows = static_cast<std::size_t>(state.range(0));
+    const auto cols = static_cast<std::size_t>(state.range(1));
+    Vector2D<float> mdim(rows, cols, Padded ? Vector2D<float>::paddedStride(cols) : cols);
+
+    // Fixed seed
+    std::mt19937 gen(10);
+    std::uniform_real_distribution<float> dis(0.0, 1.0);
+    for (std::size_t row = 0; row < mdim.rows(); row++) {
+        for (auto& x : mdim.row(row))
+            x = dis(gen);
+    }
+
+
+    for (auto _ : state) {
+        for (std::size_t col = 0; col < mdim.columns(); col++) {
+            const auto column = mdim.column(col);
+            float x = 0;
+            for (std::size_t row = 0; row < column.size(); row++)
+                benchmark::DoNotOptimize(x = column[row]);
+        }
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * mdim.rows() * mdim.columns()));
+}
+
+// Walks the matrix one BlockSize x BlockSize tile at a time.
+template <std::size_t BlockSize>
+static void BM_2dvec_readAllTiled(benchmark::State& state) {
+    const CountAllocations allocations(state);
     Vector2D<float> mdim(state.range(0), state.range(1));
 
+    // Fixed seed
+    std::mt19937 gen(10);
+    std::uniform_real_distribution<float> dis(0.0, 1.0);
+    for (std::size_t row = 0; row < mdim.rows(); row++) {
+        for (auto& x : mdim.row(row))
+            x = dis(gen);
+    }
+
+
+    for (auto _ : state) {
+        for (std::size_t row = 0; row < mdim.rows(); row += BlockSize) {
+            for (std::size_t col = 0; col < mdim.columns(); col += BlockSize) {
+                const auto tile = mdim.tile(row, col,
+                                            std::min(BlockSize, mdim.rows() - row),
+                                            std::min(BlockSize, mdim.columns() - col));
+                for (std::size_t r = 0; r < tile.rows(); r++) {
+                    float x = 0;
+                    for (const auto elem : tile.row(r))
+                        benchmark::DoNotOptimize(x = elem);
+                }
+            }
+        }
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * mdim.rows() * mdim.columns()));
+}
+
+// Same as BM_2dvec_readAllTiled, but the data is stored blocked, so every tile
+// is contiguous.
+template <std::size_t BlockSize>
+static void BM_2dvec_readAllBlocked(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto rows = static_cast<std::size_t>(state.range(0));
+    const auto cols = static_cast<std::size_t>(state.range(1));
+
+    const LayoutBlocked<BlockSize> layout{rows, cols};
+    std::vector<float> storage(layout.required_span_size());
+    const View2D<float, LayoutBlocked<BlockSize>> mdim(storage.data(), layout);
+
+    // Fixed seed
+    std::mt19937 gen(10);
+    std::uniform_real_distribution<float> dis(0.0, 1.0);
+    for (std::size_t row = 0; row < mdim.rows(); row++) {
+        for (std::size_t col = 0; col < mdim.columns(); col++) {
+            mdim(row, col) = dis(gen);
+        }
+    }
+
+
+    for (auto _ : state) {
+        for (std::size_t row = 0; row < mdim.rows(); row += BlockSize) {
+            for (std::size_t col = 0; col < mdim.columns(); col += BlockSize) {
+                // The tile is contiguous, so we only need the mapping to find it.
+                const float* tile = &mdim(row, col);
+                const auto height = std::min(BlockSize, mdim.rows() - row);
+                const auto width = std::min(BlockSize, mdim.columns() - col);
+                for (std::size_t r = 0; r < height; r++) {
+                    float x = 0;
+                    for (std::size_t c = 0; c < width; c++)
+                        benchmark::DoNotOptimize(x = tile[r*BlockSize + c]);
+                }
+            }
+        }
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * mdim.rows() * mdim.columns()));
+}
+
+static Vector2D<float> randomMatrix(std::size_t rows, std::size_t cols) {
+    Vector2D<float> mdim(rows, cols);
+
+    // Fixed seed
+    std::mt19937 gen(10);
+    std::uniform_real_distribution<float> dis(0.0, 1.0);
+    for (std::size_t row = 0; row < mdim.rows(); row++) {
+        for (auto& x : mdim.row(row))
+            x = dis(gen);
+    }
+
+    return mdim;
+}
+
+static void BM_2dvec_transposeNaive(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto in = randomMatrix(static_cast<std::size_t>(state.range(0)), static_cast<std::size_t>(state.range(1)));
+    Vector2D<float> out(in.columns(), in.rows());
+
+    for (auto _ : state) {
+        for (std::size_t row = 0; row < in.rows(); row++)
+            for (std::size_t col = 0; col < in.columns(); col++)
+                out.get(col, row) = in.get(row, col);
+
+        benchmark::DoNotOptimize(out.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * in.rows() * in.columns()));
+}
+
+static void BM_2dvec_transposeBlocked(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto in = randomMatrix(static_cast<std::size_t>(state.range(0)), static_cast<std::size_t>(state.range(1)));
+    Vector2D<float> out(in.columns(), in.rows());
+
+    for (auto _ : state) {
+        transposeBlocked(in, out);
+
+        benchmark::DoNotOptimize(out.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * in.rows() * in.columns()));
+}
+
+static void BM_2dvec_transposeRecursive(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto in = randomMatrix(static_cast<std::size_t>(state.range(0)), static_cast<std::size_t>(state.range(1)));
+    Vector2D<float> out(in.columns(), in.rows());
+
+    for (auto _ : state) {
+        transposeRecursive(in, out);
+
+        benchmark::DoNotOptimize(out.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * in.rows() * in.columns()));
+}
+
+static void BM_2dvec_matVecNaive(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto a = randomMatrix(static_cast<std::size_t>(state.range(0)), static_cast<std::size_t>(state.range(1)));
+    const std::vector<float> x(a.columns(), 0.5f);
+    std::vector<float> y(a.rows());
+
+    for (auto _ : state) {
+        for (std::size_t row = 0; row < a.rows(); row++) {
+            float acc = 0;
+            for (std::size_t col = 0; col < a.columns(); col++)
+                acc += a.get(row, col) * x[col];
+            y[row] = acc;
+        }
+
+        benchmark::DoNotOptimize(y.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * a.rows() * a.columns()));
+}
+
+static void BM_2dvec_matVec(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto a = randomMatrix(static_cast<std::size_t>(state.range(0)), static_cast<std::size_t>(state.range(1)));
+    const std::vector<float> x(a.columns(), 0.5f);
+    std::vector<float> y(a.rows());
+
+    for (auto _ : state) {
+        matVec<float>(a, x, y);
+
+        benchmark::DoNotOptimize(y.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * a.rows() * a.columns()));
+}
+
+// a is rows x cols and b is cols x rows, so c is rows x rows.
+static void BM_2dvec_matMulNaive(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto a = randomMatrix(static_cast<std::size_t>(state.range(0)), static_cast<std::size_t>(state.range(1)));
+    const auto b = randomMatrix(a.columns(), a.rows());
+    Vector2D<float> c(a.rows(), b.columns());
+
+    for (auto _ : state) {
+        for (std::size_t i = 0; i < a.rows(); i++) {
+            for (std::size_t j = 0; j < b.columns(); j++) {
+                float acc = 0;
+                for (std::size_t k = 0; k < a.columns(); k++)
+                    acc += a.get(i, k) * b.get(k, j);
+                c.get(i, j) = acc;
+            }
+        }
+
+        benchmark::DoNotOptimize(c.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * a.rows() * a.columns() * b.columns()));
+}
+
+static void BM_2dvec_matMulBlocked(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto a = randomMatrix(static_cast<std::size_t>(state.range(0)), static_cast<std::size_t>(state.range(1)));
+    const auto b = randomMatrix(a.columns(), a.rows());
+    Vector2D<float> c(a.rows(), b.columns());
+
+    for (auto _ : state) {
+        matMulBlocked(a, b, c);
+
+        benchmark::DoNotOptimize(c.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * a.rows() * a.columns() * b.columns()));
+}
+
+static void BM_2dvec_sumNaive(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto in = randomMatrix(static_cast<std::size_t>(state.range(0)), static_cast<std::size_t>(state.range(1)));
+
+    for (auto _ : state) {
+        float acc = 0;
+        for (std::size_t row = 0; row < in.rows(); row++)
+            for (std::size_t col = 0; col < in.columns(); col++)
+                acc += in.get(row, col);
+
+        benchmark::DoNotOptimize(acc);
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * in.rows() * in.columns()));
+}
+
+static void BM_2dvec_sum(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto in = randomMatrix(static_cast<std::size_t>(state.range(0)), static_cast<std::size_t>(state.range(1)));
+
+    for (auto _ : state) {
+        float acc = reduceElements(in, 0.0f, [](const float a, const float b) { return a + b; });
+        benchmark::DoNotOptimize(acc);
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * in.rows() * in.columns()));
+}
+
+static void BM_2dvec_map(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    const auto in = randomMatrix(static_cast<std::size_t>(state.range(0)), static_cast<std::size_t>(state.range(1)));
+    Vector2D<float> out(in.rows(), in.columns());
+
+    for (auto _ : state) {
+        mapElements(in, out, [](const float x) { return 2.0f * x + 1.0f; });
+
+        benchmark::DoNotOptimize(out.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * in.rows() * in.columns()));
+}
+
+template <typename Alloc>
+static void BM_2dvec_readRandom(benchmark::State& state) {
+    const CountAllocations allocations(state);
+    Vector2D<float, Alloc> mdim(state.range(0), state.range(1));
+
     // Fixed seed
     std::mt19937 gen(10);
     std::uniform_real_distribution<float> dis(0.0, 1.0);
@@ -124,9 +428,113 @@ BENCHMARK(BM_2dvec_readAllSeq)
     benchmark::CreateRange(8, 4*2048, 8),
 });
 
-BENCHMARK(BM_2dvec_readRandom)
+BENCHMARK(BM_2dvec_readAllRows)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 4*2048, 8),
+    benchmark::CreateRange(8, 4*2048, 8),
+});
+
+BENCHMARK_TEMPLATE(BM_2dvec_readAllColumnMajor, false)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 4*2048, 8),
+    benchmark::CreateRange(8, 4*2048, 8),
+});
+
+BENCHMARK_TEMPLATE(BM_2dvec_readAllColumnMajor, true)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 4*2048, 8),
+    benchmark::CreateRange(8, 4*2048, 8),
+});
+
+BENCHMARK_TEMPLATE(BM_2dvec_readAllTiled, 64)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 4*2048, 8),
+    benchmark::CreateRange(8, 4*2048, 8),
+});
+
+BENCHMARK_TEMPLATE(BM_2dvec_readAllBlocked, 64)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 4*2048, 8),
+    benchmark::CreateRange(8, 4*2048, 8),
+});
+
+BENCHMARK_TEMPLATE(BM_2dvec_readRandom, std::allocator<float>)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 4*2048, 8),
+    benchmark::CreateRange(8, 4*2048, 8),
+});
+
+BENCHMARK_TEMPLATE(BM_2dvec_readRandom, AlignedAllocator<float, 4096>)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 4*2048, 8),
+    benchmark::CreateRange(8, 4*2048, 8),
+});
+
+// At 4*2048 x 4*2048 floats that is 256MB, way more than the TLB can cover with
+// 4K pages, but only 128 huge pages.
+BENCHMARK_TEMPLATE(BM_2dvec_readRandom, HugePageAllocator<float>)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 4*2048, 8),
+    benchmark::CreateRange(8, 4*2048, 8),
+});
+
+BENCHMARK(BM_2dvec_transposeNaive)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 4*2048, 8),
+    benchmark::CreateRange(8, 4*2048, 8),
+});
+
+BENCHMARK(BM_2dvec_transposeBlocked)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 4*2048, 8),
+    benchmark::CreateRange(8, 4*2048, 8),
+});
+
+BENCHMARK(BM_2dvec_transposeRecursive)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 4*2048, 8),
+    benchmark::CreateRange(8, 4*2048, 8),
+});
+
+BENCHMARK(BM_2dvec_matVecNaive)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 4*2048, 8),
+    benchmark::CreateRange(8, 4*2048, 8),
+});
+
+BENCHMARK(BM_2dvec_matVec)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 4*2048, 8),
+    benchmark::CreateRange(8, 4*2048, 8),
+});
+
+// The full grid is out of reach for the naive matMul, so we stop at 512.
+BENCHMARK(BM_2dvec_matMulNaive)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 512, 8),
+    benchmark::CreateRange(8, 512, 8),
+});
+
+BENCHMARK(BM_2dvec_matMulBlocked)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 512, 8),
+    benchmark::CreateRange(8, 512, 8),
+});
+
+BENCHMARK(BM_2dvec_sumNaive)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 4*2048, 8),
+    benchmark::CreateRange(8, 4*2048, 8),
+});
+
+BENCHMARK(BM_2dvec_sum)
 ->ArgsProduct( {
     benchmark::CreateRange(8, 4*2048, 8),
     benchmark::CreateRange(8, 4*2048, 8),
 });
 
+BENCHMARK(BM_2dvec_map)
+->ArgsProduct( {
+    benchmark::CreateRange(8, 4*2048, 8),
+    benchmark::CreateRange(8, 4*2048, 8),
+});
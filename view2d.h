@@ -0,0 +1,160 @@
+#pragma once
+
+// Non-owning views over 2D data, modelled on std::mdspan, which we don't have yet.
+// A View2D is a pointer plus a mapping, where the mapping turns (row, col) into an
+// offset from the pointer, just like an mdspan layout mapping. Where <mdspan> is
+// available, the strided mappings can be turned into a real std::mdspan.
+
+#include <cstddef>
+#include <span>
+#include <type_traits>
+#include <version>
+
+#ifdef __cpp_lib_mdspan
+#include <array>
+#include <mdspan>
+#endif
+
+// Row-major, with rows stride elements apart. Same as std::layout_right when
+// stride == cols.
+struct LayoutRight {
+    std::size_t rows;
+    std::size_t cols;
+    std::size_t stride;
+
+    [[nodiscard]] constexpr std::size_t operator()(std::size_t r, std::size_t c) const {
+        return r*stride + c;
+    }
+
+    [[nodiscard]] constexpr std::size_t required_span_size() const {
+        return rows == 0 || cols == 0 ? 0 : (rows-1)*stride + cols;
+    }
+};
+
+// Column-major, with columns stride elements apart. Same as std::layout_left when
+// stride == rows.
+struct LayoutLeft {
+    std::size_t rows;
+    std::size_t cols;
+    std::size_t stride;
+
+    [[nodiscard]] constexpr std::size_t operator()(std::size_t r, std::size_t c) const {
+        return c*stride + r;
+    }
+
+    [[nodiscard]] constexpr std::size_t required_span_size() const {
+        return rows == 0 || cols == 0 ? 0 : (cols-1)*stride + rows;
+    }
+};
+
+// Square tiles of BlockSize x BlockSize elements, each stored contiguously and
+// row-major, with the tiles themselves in row-major order. The edge tiles are
+// stored whole, so the storage is rounded up to whole tiles.
+template <std::size_t BlockSize>
+struct LayoutBlocked {
+    static_assert(0 < BlockSize, "The block size must be positive");
+
+    std::size_t rows;
+    std::size_t cols;
+
+    [[nodiscard]] constexpr std::size_t tilesPerRow() const {
+        return (cols + BlockSize - 1) / BlockSize;
+    }
+
+    [[nodiscard]] constexpr std::size_t operator()(std::size_t r, std::size_t c) const {
+        const auto tile = (r / BlockSize) * tilesPerRow() + c / BlockSize;
+        return tile * BlockSize * BlockSize + (r % BlockSize) * BlockSize + c % BlockSize;
+    }
+
+    [[nodiscard]] constexpr std::size_t required_span_size() const {
+        return (rows + BlockSize - 1) / BlockSize * tilesPerRow() * BlockSize * BlockSize;
+    }
+};
+
+// A view of every stride'th element, such as a column of row-major data.
+template <typename T>
+class StridedSpan {
+    T* data_{nullptr};
+    std::size_t size_{0};
+    std::size_t stride_{1};
+
+public:
+    constexpr StridedSpan(T* data, std::size_t size, std::size_t stride) : data_{data}, size_{size}, stride_{stride} {}
+
+    [[nodiscard]] constexpr std::size_t size() const {
+        return size_;
+    }
+
+    [[nodiscard]] constexpr std::size_t stride() const {
+        return stride_;
+    }
+
+    [[nodiscard]] constexpr T& operator[](std::size_t i) const {
+        return data_[i*stride_];
+    }
+};
+
+template <typename T, typename Mapping = LayoutRight>
+class View2D {
+    T* data_{nullptr};
+    Mapping map_;
+
+public:
+    constexpr View2D(T* data, Mapping map) : data_{data}, map_{map} {}
+
+    [[nodiscard]] constexpr std::size_t rows() const {
+        return map_.rows;
+    }
+
+    [[nodiscard]] constexpr std::size_t columns() const {
+        return map_.cols;
+    }
+
+    [[nodiscard]] constexpr const Mapping& mapping() const {
+        return map_;
+    }
+
+    [[nodiscard]] constexpr T* data() const {
+        return data_;
+    }
+
+    [[nodiscard]] constexpr T& operator()(std::size_t r, std::size_t c) const {
+        return data_[map_(r, c)];
+    }
+
+    // The rest only make sense when the rows or columns are strided.
+
+    [[nodiscard]] constexpr std::span<T> row(std::size_t r) const requires std::is_same_v<Mapping, LayoutRight> {
+        return {data_ + map_(r, 0), map_.cols};
+    }
+
+    [[nodiscard]] constexpr StridedSpan<T> column(std::size_t c) const requires std::is_same_v<Mapping, LayoutRight> {
+        return {data_ + map_(0, c), map_.rows, map_.stride};
+    }
+
+    // The rows x cols sub matrix, starting at (r, c).
+    [[nodiscard]] constexpr View2D tile(std::size_t r, std::size_t c, std::size_t rows, std::size_t cols) const
+        requires std::is_same_v<Mapping, LayoutRight> || std::is_same_v<Mapping, LayoutLeft> {
+        return {data_ + map_(r, c), Mapping{rows, cols, map_.stride}};
+    }
+
+    // The same data, with rows and columns swapped.
+    [[nodiscard]] constexpr auto transposed() const
+        requires std::is_same_v<Mapping, LayoutRight> || std::is_same_v<Mapping, LayoutLeft> {
+        using Other = std::conditional_t<std::is_same_v<Mapping, LayoutRight>, LayoutLeft, LayoutRight>;
+        return View2D<T, Other>{data_, Other{map_.cols, map_.rows, map_.stride}};
+    }
+
+#ifdef __cpp_lib_mdspan
+    [[nodiscard]] auto to_mdspan() const
+        requires std::is_same_v<Mapping, LayoutRight> || std::is_same_v<Mapping, LayoutLeft> {
+        using Extents = std::dextents<std::size_t, 2>;
+        const auto strides = std::is_same_v<Mapping, LayoutRight>
+                ? std::array<std::size_t, 2>{map_.stride, 1}
+                : std::array<std::size_t, 2>{1, map_.stride};
+
+        return std::mdspan<T, Extents, std::layout_stride>(
+                data_, std::layout_stride::mapping<Extents>(Extents(map_.rows, map_.cols), strides));
+    }
+#endif
+};